@@ -302,7 +302,7 @@ struct tcphdr {
 
 #if (__AVR_ENDIAN == __LITTLE_ENDIAN)
 
-#define htons(n) ( ((uint16_t)(n) << 8) | ((uint16_t)(n) >> 8) )
+#define htons(n) ( (uint16_t)(((uint16_t)(n) << 8) | ((uint16_t)(n) >> 8)) )
 #define ntohs(n) htons(n)
 
 #define htonl(n) (((((uint32_t)(n) & 0xFF)) << 24) | \
@@ -16,26 +16,96 @@
 #include "aSocket.h"
 #include "spiBus.h"
 
+aInetStack InetStack;
+
+
+// Internet checksum (RFC 1071) in memory byte order, sum is a folded partial sum
+// of data before addr. Words are added with end-around carry, four bytes a pass.
+uint16_t checksum(uint16_t* addr, uint16_t len, uint16_t sum = 0) {
+
+#if defined(__AVR__) && !defined(ENC28J60_EMU)
+	uint8_t *p = (uint8_t*)addr;
+
+	while ( len >= 4 ) {
+
+		// dec leaves the carry alone, so it runs through the whole block
+		uint8_t n = ( len >= 4*255 ) ? 255 : len>>2;
+		len -= (uint16_t)n<<2;
+
+		__asm__ __volatile__ (
+			"clc"						"\n\t"
+			"1:"						"\n\t"
+			"ld __tmp_reg__, %a1+"		"\n\t"
+			"adc %A0, __tmp_reg__"		"\n\t"
+			"ld __tmp_reg__, %a1+"		"\n\t"
+			"adc %B0, __tmp_reg__"		"\n\t"
+			"ld __tmp_reg__, %a1+"		"\n\t"
+			"adc %A0, __tmp_reg__"		"\n\t"
+			"ld __tmp_reg__, %a1+"		"\n\t"
+			"adc %B0, __tmp_reg__"		"\n\t"
+			"dec %2"					"\n\t"
+			"brne 1b"					"\n\t"
+			// end-around carry
+			"adc %A0, __zero_reg__"		"\n\t"
+			"adc %B0, __zero_reg__"		"\n\t"
+			"adc %A0, __zero_reg__"		"\n\t"
+			: "+r" (sum), "+e" (p), "+r" (n)
+			:
+			// the block read through p may have just been stored, e.g. ip->check
+			: "memory"
+		);
+	}
+
+	uint32_t acc = sum;
+
+	if ( len > 1 ) {
+		acc += *(uint16_t*)p;
+		p += 2;
+		len -= 2;
+	}
 
-uint16_t checksum(uint16_t* addr, uint16_t len) {
+	if ( len > 0 ) acc += *p;
+#else
+	uint32_t acc = sum;
 
-	uint32_t sum = 0;
+	while ( len > 3 ) {
 
-	while ( len > 1 ) {
+		acc += addr[0];
+		acc += addr[1];
+		addr += 2;
+		len -= 4;
+	}
 
-		sum += *addr++;
+	if ( len > 1 ) {
+		acc += *addr++;
 		len -= 2;
 	}
 
-	if ( len > 0 ) sum += (uint16_t) *(uint8_t*)addr;
+	if ( len > 0 ) acc += (uint16_t) *(uint8_t*)addr;
+#endif
+
+	while ( acc>>16 )
+			acc = (acc & 0xffff) + (acc >> 16);
+
+return ~acc;
+}
+
+// Incremental checksum update when a 16-bit header field changes from m to m1,
+// RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'). Values are in packet byte order.
+uint16_t csum_replace( uint16_t check, uint16_t m, uint16_t m1 ) {
 
-	while ( sum>>16 )
-			sum = (sum & 0xffff) + (sum >> 16);
+	uint32_t acc = (uint16_t)~check;
 
-return ~sum;
+	acc += (uint16_t)~m;
+	acc += m1;
+
+	while ( acc>>16 )
+			acc = (acc & 0xffff) + (acc >> 16);
+
+return ~acc;
 }
 
-void aSocket::MakeEthReply( struct ethhdr *eth ) {
+void aInetStack::MakeEthReply( struct ethhdr *eth ) {
 
 	for ( uint8_t i = 0 ; i < ETH_ALEN ; i++ ) {
 		eth->h_dest[i] = eth->h_source[i];
@@ -43,22 +113,24 @@ void aSocket::MakeEthReply( struct ethhdr *eth ) {
 	}
 }
 
-void aSocket::MakeIpReply( struct iphdr *ip, uint16_t tot_len ) {
+void aInetStack::MakeIpReply( struct iphdr *ip, uint16_t tot_len ) {
 
 	if ( tot_len ) {
 
 		tot_len = htons(tot_len);
 
 		if ( ip->tot_len != tot_len ) {
+			ip->check = csum_replace( ip->check, ip->tot_len, tot_len );
 			ip->tot_len = tot_len;
-
-			ip->check = 0;
-			ip->check = checksum((uint16_t*)ip, IPHDR_SIZE);
 		}
 	}
 
-	ip->id += 1;
-	ip->check -= 1;
+	uint16_t id = htons( ntohs(ip->id) + 1 );
+
+	ip->check = csum_replace( ip->check, ip->id, id );
+	ip->id = id;
+
+	// addresses are swapped and the destination was ours, the sum stays
 
 	ip->daddr = ip->saddr;
 	ip->saddr = ipaddr;
@@ -67,7 +139,7 @@ void aSocket::MakeIpReply( struct iphdr *ip, uint16_t tot_len ) {
 void aSocket::MakeEth( struct ethhdr *eth, uint16_t h_proto ) {
 
 	for ( uint8_t i = 0 ; i < ETH_ALEN ; i++ ) {
-		eth->h_source[i] = hwaddr[i];
+		eth->h_source[i] = InetStack.hwaddr[i];
 		eth->h_dest[i] = peerhwaddr[i];
 	}
 	eth->h_proto = htons(h_proto);
@@ -84,22 +156,42 @@ void aSocket::MakeIp( struct iphdr *ip, uint16_t tot_len, uint8_t protocol ) {
 	ip->ttl = IPDEFTTL;
 	ip->protocol = protocol;
 	ip->check = 0;
-	ip->saddr = ipaddr;
+	ip->saddr = InetStack.ipaddr;
 	ip->daddr = peeripaddr;
 	ip->check = checksum((uint16_t*)ip, IPHDR_SIZE);
 }
 
+// Header of a data frame whose TX slot holds this connection's headers already. Only
+// tot_len and id differ from the last frame sent, its checksum is patched (RFC 1624).
+void aSocket::PatchIp( struct iphdr *ip, uint16_t tot_len ) {
+
+	tot_len = htons(tot_len);
+
+	ip->tot_len = tot_len;
+	ip->id = htons( ntohs(ipid) + 1 );
+	ip->frag_off = 0x0040;			// Don't fragment set
+	ip->ttl = IPDEFTTL;
+	ip->protocol = protocol;
+	ip->check = csum_replace( csum_replace( ipcheck, iptot_len, tot_len ), ipid, ip->id );
+	// not written to the slot, the pseudo header of the transport checksum takes them
+	ip->saddr = InetStack.ipaddr;
+	ip->daddr = peeripaddr;
+}
+
 #ifdef ASOCKET_COMPILE_TCP
 void aSocket::MakeTcp( struct tcphdr *tcp, uint8_t tcpflags, uint16_t datalen, uint8_t flags ) {
 
 	tcp->source = port;
 	tcp->dest = peerport;
-	tcp->seq = seq;
+	tcp->seq = IncNetNum(seq,seq_adv);
 	tcp->ack_seq = ack;
+	ackpend = 0;
 	tcp->doff = (TCPHDR_SIZE+((flags&ASOCKET_TCP_OPT) ? 8 : 0))>>2;
 	tcp->res1 = 0;
 	tcp->flags = tcpflags;
-	tcp->window = htons(TCP_MSS_DEFAULT);
+	// what is left of our part of the RX staging buffer
+	rcvadv = RcvWnd();
+	tcp->window = htons(rcvadv);
 	tcp->urg_ptr = 0;
 
 	if ( flags & ASOCKET_TCP_OPT ) {
@@ -108,8 +200,8 @@ void aSocket::MakeTcp( struct tcphdr *tcp, uint8_t tcpflags, uint16_t datalen, u
 		uint8_t *opt = ((uint8_t*)tcp+TCPHDR_SIZE);
 		opt[0] = 2;
 		opt[1] = 4;
-		opt[2] = TCP_MSS_DEFAULT>>8;
-		opt[3] = TCP_MSS_DEFAULT&0xff;
+		opt[2] = ASOCKET_RCVMSS>>8;
+		opt[3] = ASOCKET_RCVMSS&0xff;
 		// include SACK option
 		opt[4] = 4;
 		opt[5] = 2;
@@ -122,7 +214,13 @@ void aSocket::MakeTcp( struct tcphdr *tcp, uint8_t tcpflags, uint16_t datalen, u
 	if ( flags & ASOCKET_CHECKSUM ) {
 		tcp->check = htons((tcp->doff<<2) + IPPROTO_TCP + datalen);
 		tcp->check = checksum( (uint16_t*)(((uint8_t*)tcp)-8), 8+(tcp->doff<<2)+datalen );
-	} else 
+#ifdef ENC28J60_SPISUM
+	} else if ( flags & ASOCKET_SPISUM ) {
+		// data went to the TX slot already, summed on the way
+		tcp->check = htons((tcp->doff<<2) + IPPROTO_TCP + datalen);
+		tcp->check = checksum( (uint16_t*)(((uint8_t*)tcp)-8), 8+(tcp->doff<<2), enc28j60_TxSum() );
+#endif
+	} else
 		tcp->check = 0;
 }
 #endif
@@ -138,17 +236,25 @@ void aSocket::MakeUdp( struct udphdr *udp, uint16_t datalen, uint8_t flags ) {
 	if ( flags & ASOCKET_CHECKSUM ) {
 		udp->check = htons(UDPHDR_SIZE + IPPROTO_UDP + datalen);
 		udp->check = checksum( (uint16_t*)(((uint8_t*)udp)-8), 8+UDPHDR_SIZE+datalen );
+#ifdef ENC28J60_SPISUM
+	} else if ( flags & ASOCKET_SPISUM ) {
+		udp->check = htons(UDPHDR_SIZE + IPPROTO_UDP + datalen);
+		udp->check = checksum( (uint16_t*)(((uint8_t*)udp)-8), 8+UDPHDR_SIZE, enc28j60_TxSum() );
+#endif
 	} else
 		udp->check = 0;
 }
 #endif
 
-uint16_t aSocket::OnChipChecksum( uint16_t pktaddr, uint8_t prot, uint16_t datalen ) {
+uint16_t aInetStack::OnChipChecksum( uint16_t pktaddr, uint8_t prot, uint16_t datalen ) {
 
 	uint16_t cs;
 	uint16_t csoff;
 	
+	uint8_t rxring = ( pktaddr <= RXSTOP_INIT );
+
 	pktaddr += ETHHDR_SIZE + IPHDR_SIZE;
+	if ( rxring ) pktaddr = enc28j60_RxAddr( pktaddr );
 
 	switch ( prot ) {
 	
@@ -163,35 +269,96 @@ uint16_t aSocket::OnChipChecksum( uint16_t pktaddr, uint8_t prot, uint16_t datal
 		datalen += UDPHDR_SIZE;
 		cs = IPPROTO_UDP + datalen;
 	break;
+
+	// no checksum field to fill
+	default:
+	return 0;
 	}
 	
+	if ( rxring ) csoff = enc28j60_RxAddr( csoff );
+
 	cs = htons(cs);
 	enc28j60_WriteMem( csoff, (uint8_t*)&cs, sizeof(uint16_t) );
 
-	cs = htons( enc28j60_checksum( pktaddr-8, 8+datalen ) );
+	cs = htons( enc28j60_checksum( rxring ? enc28j60_RxAddr(pktaddr-8) : pktaddr-8, 8+datalen ) );
 
 	enc28j60_WriteMem( csoff, (uint8_t*)&cs, sizeof(uint16_t) );
 	
 return cs;
 }
 
-void aSocket::DispatchPacket( uint16_t pktlen ) {
+// Checksum of the received segment whose headers are in pktbuf. Short data is
+// summed while it is read over SPI, long data by the DMA engine in the chip.
+uint16_t aInetStack::RxChecksum( uint8_t prot, uint16_t datalen ) {
 
-	enc28j60_NewPacket( pktlen );
-	enc28j60_WritePacketData( 0, pktbuf, pktlen, 0 );
-	enc28j60_SendNewPacket();
+#ifdef ENC28J60_SPISUM
+	if ( datalen <= ASOCKET_SPISUMMAX ) {
+
+		uint8_t *hdr = pktbuf + ETHHDR_SIZE + IPHDR_SIZE;
+		uint16_t hdrsize = ( prot == IPPROTO_TCP ) ? TCPHDR_SIZE : UDPHDR_SIZE;
+		uint16_t *check = (uint16_t*)( hdr + (( prot == IPPROTO_TCP ) ? memoff(0,struct tcphdr,check) : memoff(0,struct udphdr,check)) );
+		uint16_t saved = *check;
+		uint16_t cs;
+
+		*check = htons( prot + hdrsize + datalen );
+		cs = checksum( (uint16_t*)(hdr-8), 8+hdrsize, enc28j60_SumPacketData(ETHHDR_SIZE+IPHDR_SIZE+hdrsize, datalen) );
+		*check = saved;
+
+	return cs;
+	}
+#endif
+
+return OnChipChecksum( enc28j60_ReceivedPktAddr(), prot, datalen );
+}
+
+// Frames built in pktbuf go out of the chip's control frame area,
+// a data frame sitting in the TX buffer is left alone.
+void aInetStack::DispatchPacket( uint16_t pktlen ) {
+
+#ifdef ENC28J60_STATS
+	enc28j60_GetStats( &txcost );
+#endif
+
+	enc28j60_SendCtrlPacket( pktlen, pktbuf );
+
+#ifdef ENC28J60_STATS
+	enc28j60_StatsDelta( &txcost );
+#endif
+}
+
+void aInetStack::FreeReceivedPkt() {
+
+	enc28j60_FreeReceivedPkt();
+
+#ifdef ENC28J60_STATS
+	rxcost = rxsnap;
+	enc28j60_StatsDelta( &rxcost );
+#endif
 }
 
-void aSocket::copyhwa( uint8_t *srchwa, uint8_t *dsthwa ) {
+void aInetStack::copyhwa( uint8_t *srchwa, uint8_t *dsthwa ) {
 
 		for ( uint8_t i = 0 ; i < ETH_ALEN ; i++ ) dsthwa[i] = srchwa[i];
 }
 
-uint32_t aSocket::subnet( uint32_t ip ) {
+uint32_t aInetStack::subnet( uint32_t ip ) {
 
 	return ((((uint32_t)-1) >> (32-netmask)) << (32-netmask)) & ntohl(ip);
 }
 
+// the limited broadcast address or the one of our subnet
+uint8_t aInetStack::Broadcast( uint32_t ip ) {
+
+	// host bits all set, subnet(INADDR_BROADCAST) is the netmask
+	return ip == INADDR_BROADCAST || ( subnet(ip) == subnet(ipaddr) && (ntohl(ip) | subnet(INADDR_BROADCAST)) == INADDR_BROADCAST );
+}
+
+// do we need to use gateway?
+uint32_t aInetStack::NextHop( uint32_t ip ) {
+
+	return ( subnet(ipaddr) != subnet(ip) ) ? gatewayip : ip;
+}
+
 #ifdef ASOCKET_COMPILE_TCP
 // generate pseudo random number for seq
 void aSocket::InitSEQ() {
@@ -201,16 +368,22 @@ void aSocket::InitSEQ() {
 
 }
 
-uint32_t aSocket::IncNetNum( uint32_t &num, uint16_t addval ) {
+uint32_t aSocket::IncNetNum( uint32_t num, uint16_t addval ) {
 
 	return htonl( ntohl(num) + addval);
 }
 
 void aSocket::SendTCPSYN() {
 
+	uint8_t *pktbuf = InetStack.pktbuf;
+
 	InitSEQ();
 	ack = 0;
 
+	// every SYN has its own ISN, so even a retransmitted one gives a valid sample
+	rtton = 1;
+	rtttime = millis();
+
 	MakeEth( (struct ethhdr*)pktbuf, ETH_P_IP );
 
 	// +4 for MSS option, +4 for SACK
@@ -219,11 +392,151 @@ void aSocket::SendTCPSYN() {
 
 	seq = IncNetNum(seq,1);
 
-	DispatchPacket( ETHHDR_SIZE+IPHDR_SIZE+TCPHDR_SIZE+8 );
+	InetStack.DispatchPacket( ETHHDR_SIZE+IPHDR_SIZE+TCPHDR_SIZE+8 );
+}
+
+void aSocket::RttSample( uint16_t rtt ) {
+
+	rtton = 0;
+
+	if ( !srtt ) {
+		srtt = rtt;
+		rttvar = rtt >> 1;
+	} else {
+		rttvar = ( 3*(uint32_t)rttvar + ((srtt > rtt) ? srtt - rtt : rtt - srtt) ) >> 2;
+		srtt = ( 7*(uint32_t)srtt + rtt ) >> 3;
+	}
+
+	SetRto();
+}
+
+// rto from the estimate, RFC 6298
+void aSocket::SetRto() {
+
+	uint32_t t = srtt + ((rttvar) ? 4*(uint32_t)rttvar : 1);
+
+	rto = ( t < ASOCKET_RTOMIN ) ? ASOCKET_RTOMIN : ( t > ASOCKET_RTOMAX ) ? ASOCKET_RTOMAX : t;
+}
+
+// a retransmission, its answer can't be timed (Karn)
+void aSocket::Backoff() {
+
+	rtton = 0;
+	rto = ( rto < ASOCKET_RTOMAX/2 ) ? rto << 1 : ASOCKET_RTOMAX;
+}
+
+// options of a SYN, only MSS is of interest
+void aSocket::PeerOptions( struct tcphdr *tcp, uint16_t tcpoffset ) {
+
+	uint8_t *opt = (uint8_t*)tcp + TCPHDR_SIZE;
+	uint8_t optlen = (tcp->doff<<2) - TCPHDR_SIZE;
+
+	// RFC 1122, a peer which doesn't tell takes the default
+	sndmss = TCP_MSS_DEFAULT;
+
+	if ( tcp->doff <= (TCPHDR_SIZE>>2) ) return;
+
+	enc28j60_ReadPacketData( tcpoffset+TCPHDR_SIZE, opt, optlen );
+
+	for ( uint16_t i = 0 ; i < optlen ; ) {
+
+		if ( opt[i] == 0 ) break;			// end of list
+		if ( opt[i] == 1 ) { i++; continue; }	// nop
+
+		// a length that doesn't move forward or runs past the options ends parsing
+		if ( i+1 >= optlen || opt[i+1] < 2 || i + opt[i+1] > optlen ) break;
+
+		if ( opt[i] == 2 && opt[i+1] == 4 && i+3 < optlen ) {
+			sndmss = (opt[i+2]<<8) | opt[i+3];
+			if ( sndmss > ASOCKET_MSS ) sndmss = ASOCKET_MSS;
+			// a zero or tiny MSS would leave no room for data in any segment
+			if ( sndmss < ASOCKET_MINMSS ) sndmss = ASOCKET_MINMSS;
+		}
+
+		i += opt[i+1];
+	}
+}
+
+// The peer's cumulative ack and window. Returns 0 when the ack covers more than we sent.
+uint8_t aSocket::TakeAck( struct tcphdr *tcp ) {
+
+	// from nothing up to all we have sent
+	uint32_t acked = ntohl(tcp->ack_seq) - ntohl(seq);
+
+	if ( acked > seq_adv ) return 0;
+
+	if ( acked ) {
+		seq = tcp->ack_seq;
+		seq_adv -= acked;
+		InetStack.TxRelease( this );
+
+		if ( rtton && (int32_t)(ntohl(seq) - rttseq) >= 0 ) RttSample( (uint16_t)millis() - rtttime );
+		// New data got through after retransmissions, the backoff is over. No segment
+		// may be sent to give a new sample while the application waits for room.
+		else if ( retries && srtt ) SetRto();
+
+		// progress, the retransmission timer starts over
+		retries = 0;
+		txtime = millis();
+	}
+
+	sndwnd = ntohs(tcp->window);
+
+return 1;
+}
+
+// segment without data, built in pktbuf
+void aSocket::SendTCPCtrl( uint8_t tcpflags ) {
+
+	uint8_t *pktbuf = InetStack.pktbuf;
+
+	MakeEth( (struct ethhdr*)pktbuf, ETH_P_IP );
+	MakeIp( (struct iphdr*)(pktbuf+ETHHDR_SIZE), IPHDR_SIZE+TCPHDR_SIZE, IPPROTO_TCP );
+	MakeTcp( (struct tcphdr*)(pktbuf+ETHHDR_SIZE+IPHDR_SIZE), tcpflags, 0, ASOCKET_CHECKSUM );
+	InetStack.DispatchPacket( ETHHDR_SIZE+IPHDR_SIZE+TCPHDR_SIZE );
+}
+
+// Zero window probe. The sequence number is one below what the peer expects,
+// so it answers with an ack carrying its current window (RFC 1122 4.2.2.17).
+void aSocket::SendTCPProbe() {
+
+	uint32_t s = seq;
+
+	seq = htonl( ntohl(seq) - 1 );
+	SendTCPCtrl( TCP_FLAG_ACK );
+	seq = s;
+}
+
+// A segment sent again carries the ack and window of now, those it was built with
+// may be older than the peer accepts. Its checksum is patched (RFC 1624).
+void aSocket::PatchTcp() {
+
+	// ack_seq, doff and flags, window, check
+	uint16_t f[5];
+	uint16_t addr = enc28j60_NewPktAddr() + ETHHDR_SIZE + IPHDR_SIZE + memoff(0,struct tcphdr,ack_seq);
+	uint16_t *a = (uint16_t*)&ack;
+	uint16_t window;
+
+	enc28j60_ReadMem( addr, (uint8_t*)f, sizeof(f) );
+
+	ackpend = 0;
+	rcvadv = RcvWnd();
+	window = htons(rcvadv);
+
+	if ( f[0] == a[0] && f[1] == a[1] && f[3] == window ) return;
+
+	f[4] = csum_replace( f[4], f[0], a[0] );
+	f[4] = csum_replace( f[4], f[1], a[1] );
+	f[4] = csum_replace( f[4], f[3], window );
+	f[0] = a[0];
+	f[1] = a[1];
+	f[3] = window;
+
+	enc28j60_WriteMem( addr, (uint8_t*)f, sizeof(f) );
 }
 #endif
 
-void aSocket::QueryARP() {
+void aInetStack::QueryARP( uint32_t ip ) {
 
 	struct ethhdr *eth = (struct ethhdr*)pktbuf;
 
@@ -237,7 +550,7 @@ void aSocket::QueryARP() {
 	arp->ar_op = htons(ARPOP_REQUEST);
 
 	arp->ar_sip = ipaddr;
-	arp->ar_tip = peeripaddr;
+	arp->ar_tip = ip;
 
 	for ( uint8_t i = 0 ; i < ETH_ALEN ; i++ ) {
 		eth->h_source[i] = hwaddr[i];
@@ -250,22 +563,209 @@ void aSocket::QueryARP() {
 
 }
 
-void aSocket::HandleInetStack( uint32_t timeout ) {
+#ifdef ASOCKET_ARPCACHE
+// remember hardware address of a host, the oldest entry makes room for a new one
+void aInetStack::ArpLearn( uint32_t ip, uint8_t *hwa ) {
+
+	uint16_t now = millis() >> 10;
+	struct arpentry *e = arpcache;
+
+	if ( ip == INADDR_NONE || !ip ) return;
+
+	for ( uint8_t i = 0 ; i < ASOCKET_ARPCACHE ; i++ ) {
+
+		if ( arpcache[i].ipaddr == ip ) {
+			e = &arpcache[i];
+			break;
+		}
+
+		if ( !arpcache[i].ipaddr ) e = &arpcache[i];
+		else if ( e->ipaddr && (uint16_t)(now - arpcache[i].time) > (uint16_t)(now - e->time) ) e = &arpcache[i];
+	}
+
+	e->ipaddr = ip;
+	copyhwa( hwa, e->hwaddr );
+	e->time = now;
+}
+
+uint8_t aInetStack::ArpLookup( uint32_t ip, uint8_t *hwa ) {
+
+	for ( uint8_t i = 0 ; i < ASOCKET_ARPCACHE ; i++ ) {
+
+		if ( arpcache[i].ipaddr != ip ) continue;
+
+		if ( (uint16_t)((millis() >> 10) - arpcache[i].time) >= ASOCKET_ARPAGE ) {
+			arpcache[i].ipaddr = 0;
+			break;
+		}
+
+		copyhwa( arpcache[i].hwaddr, hwa );
+		return 1;
+	}
+
+return 0;
+}
+
+void aInetStack::ArpForget( uint32_t ip ) {
+
+	for ( uint8_t i = 0 ; i < ASOCKET_ARPCACHE ; i++ )
+		if ( arpcache[i].ipaddr == ip ) arpcache[i].ipaddr = 0;
+}
+#endif
+
+// Take a slot in the socket table, its index picks the socket's part of the RX staging buffer.
+int8_t aInetStack::Attach( aSocket *sock ) {
+
+	int8_t slot = -1;
+
+	// a new connection, headers the socket left in TX slots are stale
+	for ( uint8_t i = 0 ; i < TXSLOTS ; i++ )
+		if ( txq[i].hdr == sock ) txq[i].hdr = NULL;
+
+	for ( uint8_t i = 0 ; i < ASOCKET_MAXSOCKS ; i++ ) {
+
+		if ( socks[i] == sock ) return i;
+		if ( !socks[i] && slot < 0 ) slot = i;
+	}
+
+	if ( slot < 0 ) return -1;
+
+	socks[slot] = sock;
+	sock->rxbuf = RXBUFFER + slot*ASOCKET_RXSHARE;
+
+return slot;
+}
+
+void aInetStack::Detach( aSocket *sock ) {
+
+	for ( uint8_t i = 0 ; i < ASOCKET_MAXSOCKS ; i++ )
+		if ( socks[i] == sock ) socks[i] = NULL;
+
+	for ( uint8_t i = 0 ; i < TXSLOTS ; i++ ) {
+		if ( txq[i].owner == sock ) txq[i].owner = NULL;
+		if ( txq[i].hdr == sock ) txq[i].hdr = NULL;
+	}
+
+	sock->txslot = -1;
+
+	UpdateRxFilter();
+}
+
+// A connected socket wins over a listening one on the same port.
+aSocket* aInetStack::FindSocket( uint8_t prot, uint16_t port, uint32_t peerip, uint16_t peerport ) {
+
+	aSocket *listener = NULL;
+
+	for ( uint8_t i = 0 ; i < ASOCKET_MAXSOCKS ; i++ ) {
+
+		aSocket *s = socks[i];
+
+		if ( !s || s->protocol != prot || s->port != port ) continue;
+
+		if ( s->constate == ASOCK_LISTEN ) listener = s;
+		else if ( s->peeripaddr == peerip && s->peerport == peerport ) return s;
+	}
+
+return listener;
+}
+
+// Only frames the stack can use get into the RX ring. Unicast for our address and ARP
+// requests for us (pattern set in setup()) are always taken, ping is answered with no
+// socket open. Broadcasts are taken only while a UDP socket listens, nothing else can
+// use them. Multicast stays off, no socket joins a group.
+void aInetStack::UpdateRxFilter() {
+
+	uint8_t flags = ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN;
+
+	for ( uint8_t i = 0 ; i < ASOCKET_MAXSOCKS ; i++ )
+		if ( socks[i] && socks[i]->protocol == IPPROTO_UDP && socks[i]->constate == ASOCK_LISTEN ) flags |= ERXFCON_BCEN;
+
+	enc28j60_SetRxFilter( flags );
+}
+
+int8_t aInetStack::TxFree() {
+
+	for ( uint8_t i = 0 ; i < TXSLOTS ; i++ )
+		if ( !txq[i].owner ) return i;
+
+return -1;
+}
+
+// takes a TX slot for a new frame
+int8_t aInetStack::TxAlloc( aSocket *sock ) {
+
+	int8_t slot = TxFree();
+
+	if ( slot >= 0 ) txq[slot].owner = sock;
+
+return slot;
+}
+
+#ifdef ASOCKET_COMPILE_TCP
+// frees the slots of segments covered by the socket's ack
+void aInetStack::TxRelease( aSocket *sock ) {
+
+	for ( uint8_t i = 0 ; i < TXSLOTS ; i++ ) {
+
+		if ( txq[i].owner != sock || i == sock->txslot ) continue;
+
+		if ( (int32_t)(txq[i].end - ntohl(sock->seq)) <= 0 ) txq[i].owner = NULL;
+	}
+}
+
+// the slot of the first unacknowledged segment
+uint8_t aInetStack::TxOldest( aSocket *sock ) {
+
+	uint8_t oldest = 0;
+	uint32_t dist = (uint32_t)-1;
+
+	for ( uint8_t i = 0 ; i < TXSLOTS ; i++ ) {
+
+		if ( txq[i].owner != sock || i == sock->txslot || txq[i].end - ntohl(sock->seq) >= dist ) continue;
+
+		dist = txq[i].end - ntohl(sock->seq);
+		oldest = i;
+	}
+
+return oldest;
+}
+#endif
+
+void aInetStack::HandleInetStack( uint32_t timeout, aSocket *waiter ) {
 
 	#ifdef __ASOCK_DBG__
 		_FUNCTION_DBG_INFO_
 	#endif
 
-	uint16_t datalen;
 	uint32_t m = millis();
-	constate_t	initialcs = constate;
+	constate_t	initialcs = waiter ? waiter->constate : ASOCK_CLOSED;
 
-	while ( ((millis() - m) < timeout) && initialcs == constate ) {
+	do {
 	
-		uint16_t pktlen;
+		uint16_t pktlen, rxlen;
+
+		for ( uint8_t i = 0 ; i < ASOCKET_MAXSOCKS ; i++ )
+			if ( socks[i] ) socks[i]->RunTimer();
 
-		if ( !(pktlen = enc28j60_ReceivePkt()) || pktlen > ETH_DATA_LEN ) continue;
-		enc28j60_ReadPacketData( 0, pktbuf, (pktlen < ASOCKET_BUFSIZE) ? pktlen : ASOCKET_BUFSIZE );
+#ifdef ENC28J60_STATS
+		enc28j60_GetStats( &rxsnap );
+#endif
+
+		if ( !(pktlen = rxlen = enc28j60_ReceivePkt()) ) {
+
+			// nothing pending, a poll is done
+			if ( !timeout ) return;
+			continue;
+		}
+
+		if ( pktlen > ETH_FRAME_LEN ) {
+			FreeReceivedPkt();
+			continue;
+		}
+
+		// Headers are read one layer at a time and the frame is dropped as soon as it
+		// proves not to be ours. The read pointer already sits at the start of the frame.
+		enc28j60_ReadPacketData( ENC28J60_NEXT, pktbuf, ETHHDR_SIZE );
 
 		struct ethhdr *eth = (struct ethhdr*)pktbuf;
 
@@ -277,6 +777,7 @@ void aSocket::HandleInetStack( uint32_t timeout ) {
 		if ( ntohs(eth->h_proto) == ETH_P_ARP ) {
 		
 			struct arphdr *arp = (struct arphdr*)(pktbuf+ETHHDR_SIZE);
+			enc28j60_ReadPacketData( ENC28J60_NEXT, (uint8_t*)arp, ARPHDR_SIZE );
 			
 			#ifdef __ASOCK_DBG_ARP__
 				Serial.print("ARP op: ");
@@ -289,6 +790,11 @@ void aSocket::HandleInetStack( uint32_t timeout ) {
 
 				if ( arp->ar_tip != ipaddr ) break;
 
+#ifdef ASOCKET_ARPCACHE
+				// the asking host is going to talk to us
+				ArpLearn( arp->ar_sip, arp->ar_sha );
+#endif
+
 				// make reply frame
 				for ( uint8_t i = 0 ; i < ETH_ALEN ; i++ ) {
 
@@ -303,22 +809,40 @@ void aSocket::HandleInetStack( uint32_t timeout ) {
 				arp->ar_sip = ipaddr;
 				arp->ar_op = htons(ARPOP_REPLY);
 
-				DispatchPacket( pktlen );
+				// padding is added by the chip
+				DispatchPacket( ETHHDR_SIZE+ARPHDR_SIZE );
 			break;
 
-			case ARPOP_REPLY:
-				if ( constate != ASOCK_QUERYARP || peeripaddr != arp->ar_sip ) break;
+			case ARPOP_REPLY: {
+
+				// sockets going on below reuse pktbuf
+				uint32_t sip = arp->ar_sip;
+				uint8_t sha[ETH_ALEN];
+				copyhwa(arp->ar_sha,sha);
+
+#ifdef ASOCKET_ARPCACHE
+				ArpLearn( sip, sha );
+#endif
+				// every socket waiting for this address can go on
+				for ( uint8_t i = 0 ; i < ASOCKET_MAXSOCKS ; i++ ) {
+
+					aSocket *s = socks[i];
+
+					if ( !s || s->constate != ASOCK_QUERYARP || NextHop(s->peeripaddr) != sip ) continue;
 
-				copyhwa(arp->ar_sha,peerhwaddr);
+					copyhwa(sha,s->peerhwaddr);
 
-				// we can initialize connection now
-				constate = ASOCK_INIT;
+					// we can initialize connection now
+					s->Resolved();
+				}
+			}
 			break;
 			}
 
 		} else if ( ntohs(eth->h_proto) == ETH_P_IP ) {
 		
 			struct iphdr *ip = (struct iphdr*)(pktbuf+ETHHDR_SIZE);
+			enc28j60_ReadPacketData( ENC28J60_NEXT, (uint8_t*)ip, IPHDR_SIZE );
 			
 			#ifdef __ASOCK_DBG_IP__
 				Serial.print("IP src: ");
@@ -327,19 +851,35 @@ void aSocket::HandleInetStack( uint32_t timeout ) {
 				Serial.println(ntohl(ip->daddr),HEX);
 			#endif
 
-			if ( ip->version != IPVERSION || ip->ihl != 5 || ip->daddr != ipaddr ) {
-				enc28j60_FreeReceivedPkt();
+			// broadcasts are for listening UDP sockets only
+			if ( ip->version != IPVERSION || ip->ihl != 5
+					|| ( ip->daddr != ipaddr && !(ip->protocol == IPPROTO_UDP && Broadcast(ip->daddr)) ) ) {
+				FreeReceivedPkt();
 				continue;
 			}
 
+#ifdef ASOCKET_ARPCACHE
+			if ( subnet(ip->saddr) == subnet(ipaddr) ) ArpLearn( ip->saddr, eth->h_source );
+#endif
+
 			// We can't rely on received bytes count for frames smaller than 60 bytes (+4 for crc).
 			// (for eg. tcp syn+ack, or udp packet)
+			// But the sender's length must not claim more than was received, the echo
+			// below copies that many bytes into one TX slot. rxlen is ETH_FRAME_LEN at most, a
+			// slot holds that.
 			pktlen = ntohs(ip->tot_len) + ETHHDR_SIZE;
 
-			if ( ip->protocol == IPPROTO_ICMP ) {
+			if ( pktlen > rxlen ) {
+				FreeReceivedPkt();
+				continue;
+			}
+
+			if ( ip->protocol == IPPROTO_ICMP && pktlen >= ETHHDR_SIZE+IPHDR_SIZE+ICMPHDR_SIZE ) {
 
 				struct icmphdr *icmp = (struct icmphdr*)( (uint8_t*)ip + (ip->ihl << 2) );
 
+				enc28j60_ReadPacketData( ENC28J60_NEXT, (uint8_t*)icmp, ICMPHDR_SIZE );
+
 				#ifdef __ASOCK_DBG_ICMP__
 					Serial.print("ICMP type: ");
 					Serial.println(icmp->type,HEX);
@@ -347,346 +887,766 @@ void aSocket::HandleInetStack( uint32_t timeout ) {
 
 				if ( icmp->type == ICMP_ECHO ) {
 
-					// make reply frame
+					int8_t slot = TxFree();
+
+					// make reply headers
 					MakeEthReply( eth );
 					MakeIpReply( ip, 0 );
 
-					// icmp
+					// icmp, type and code share a checksum word
+					uint16_t typecode = *(uint16_t*)icmp;
+
 					icmp->type = ICMP_ECHOREPLY;
-					icmp->checksum += 8;		// add our change to checksum
+					icmp->checksum = csum_replace( icmp->checksum, typecode, *(uint16_t*)icmp );
 
-					DispatchPacket( pktlen );
+					if ( slot >= 0 ) {
+
+#ifdef ENC28J60_STATS
+						enc28j60_GetStats( &txcost );
+#endif
+						// the chip copies the request into a free TX slot, only the headers
+						// go over SPI, so echoes of any size cost the same
+						enc28j60_TxSlot( slot );
+						enc28j60_CopyReceivedPkt( pktlen );
+						txq[slot].hdr = NULL;
+						enc28j60_WritePacketData( 0, pktbuf, ETHHDR_SIZE+IPHDR_SIZE+ICMPHDR_SIZE, 0 );
+						enc28j60_SendNewPacket();
+
+#ifdef ENC28J60_STATS
+						enc28j60_StatsDelta( &txcost );
+#endif
+					} else if ( pktlen < ASOCKET_BUFSIZE ) {
+
+						// all slots hold data frames, small echoes go through pktbuf
+						enc28j60_ReadPacketData( ENC28J60_NEXT, (uint8_t*)icmp+ICMPHDR_SIZE, pktlen-(ETHHDR_SIZE+IPHDR_SIZE+ICMPHDR_SIZE) );
+						DispatchPacket( pktlen );
+					}
 				}
 
 			} else
 
 #ifdef ASOCKET_COMPILE_UDP
-			if ( ip->protocol == IPPROTO_UDP && protocol == IPPROTO_UDP ) {
+			if ( ip->protocol == IPPROTO_UDP ) {
 				struct udphdr *udp = (struct udphdr*)( (uint8_t*)ip + (ip->ihl << 2) );
-				datalen = ntohs(udp->len) - UDPHDR_SIZE;
-				
-				#ifdef __ASOCK_DBG_UDP__
-				Serial.print("tcp: src ");
-				Serial.print(ntohs(udp->source),DEC);
-				Serial.print(" dst ");
-				Serial.println(ntohs(udp->dest),DEC);
-				Serial.print(" pktlen ");
-				Serial.println(pktlen,DEC);
-				#endif
-
-				if ( port != udp->dest || OnChipChecksum(enc28j60_ReceivedPktAddr(),IPPROTO_UDP,datalen) != udp->check ) {
-					enc28j60_FreeReceivedPkt();
-					continue;
-				}
-
-				if ( constate == ASOCK_ESTABLISHED || constate == ASOCK_LISTEN ) {
-
-					if ( datalen ) {
-
-						if ( constate == ASOCK_LISTEN ) {
-							copyhwa(eth->h_source,peerhwaddr);
-							peeripaddr = ip->saddr;
-							peerport = udp->source;
-							constate = ASOCK_ESTABLISHED;
-						}
+				enc28j60_ReadPacketData( ENC28J60_NEXT, (uint8_t*)udp, UDPHDR_SIZE );
 
-						if ( availdata+datalen > RXBUFSIZE ) datalen = RXBUFSIZE-availdata;
+				aSocket *s = FindSocket( IPPROTO_UDP, udp->dest, ip->saddr, udp->source );
 
-						enc28j60_CopyMem( enc28j60_ReceivedPktAddr()+pktlen-datalen, RXBUFFER+availdata, datalen );
-						availdata += datalen;
-
-						enc28j60_FreeReceivedPkt();
-					return;
-					}
+				if ( s && s->HandleUdp( eth, ip, udp, pktlen ) && s == waiter ) {
+					FreeReceivedPkt();
+				return;
 				}
 
 			} else
 #endif
 #ifdef ASOCKET_COMPILE_TCP
-			if ( ip->protocol == IPPROTO_TCP && protocol == IPPROTO_TCP ) {
+			if ( ip->protocol == IPPROTO_TCP ) {
 				struct tcphdr *tcp = (struct tcphdr*)( (uint8_t*)ip + (ip->ihl << 2) );
+				enc28j60_ReadPacketData( ENC28J60_NEXT, (uint8_t*)tcp, TCPHDR_SIZE );
 
-				uint16_t tcpoffset = ((uint8_t*)tcp-(uint8_t*)eth);
-				datalen = pktlen - (tcpoffset+TCPHDR_SIZE);
-
-				#ifdef __ASOCK_DBG_TCP__
-				Serial.print("tcp: src ");
-				Serial.print(ntohs(tcp->source),DEC);
-				Serial.print(" dst ");
-				Serial.println(ntohs(tcp->dest),DEC);
-				Serial.print(" flags ");
-				Serial.print(tcp->flags,HEX);
-				Serial.print(" pktlen ");
-				Serial.println(pktlen,DEC);
-				Serial.print(" check ");
-				Serial.print(OnChipChecksum(enc28j60_ReceivedPktAddr(),IPPROTO_TCP,datalen),HEX);
-				Serial.print(' ');
-				Serial.println(tcp->check,HEX);
-				#endif
+				aSocket *s = FindSocket( IPPROTO_TCP, tcp->dest, ip->saddr, tcp->source );
 
-				if ( port != tcp->dest || OnChipChecksum(enc28j60_ReceivedPktAddr(),IPPROTO_TCP,datalen) != tcp->check ) {
-					enc28j60_FreeReceivedPkt();
-					continue;
+				if ( s && s->HandleTcp( eth, ip, tcp, pktlen ) && s == waiter ) {
+					FreeReceivedPkt();
+				return;
 				}
+			}
+#else
+		{ }
+#endif
+		}
 
-				// now we can proceed
-				switch ( constate ) {
-
-				case ASOCK_INIT:
-					if ( !(tcp->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK)) || tcp->ack_seq != seq || peerport != tcp->source ) break;
+		FreeReceivedPkt();
+	} while ( (!timeout || (millis() - m) < timeout) && (!waiter || initialcs == waiter->constate) );
+}
 
-					ack = IncNetNum( tcp->seq, 1 );
+// --------------- public members
 
-					// make reply frame (we may need to cut off possible tcp options)
-					MakeEthReply( eth );
-					MakeIpReply( ip, tcpoffset+TCPHDR_SIZE-ETHHDR_SIZE );
-					MakeTcp( tcp, TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
+aInetStack::aInetStack( ) {
+}
 
-					DispatchPacket( tcpoffset+TCPHDR_SIZE );
+void aInetStack::setup( uint32_t ip, uint8_t hwa[ETH_ALEN], uint8_t mask, uint32_t gw ) {
 
-					constate = ASOCK_ESTABLISHED;
-				break;
+	copyhwa( hwa, hwaddr );
+	ipaddr = ip;
 
-				case ASOCK_LISTEN:
-					if ( tcp->flags != TCP_FLAG_SYN ) break;
+	// our addresses may have changed
+	for ( uint8_t i = 0 ; i < TXSLOTS ; i++ ) txq[i].hdr = NULL;
+	netmask = (mask > 32) ? 32 : mask;
+	gatewayip = gw;
 
-					copyhwa(eth->h_source,peerhwaddr);
-					peeripaddr = ip->saddr;
-					peerport = tcp->source;
+	// broadcasts are only let in when they are ARP requests for us:
+	// destination ff:ff:ff:ff:ff:ff, type 0x0806, opcode 1 and target IP address
+	const uint8_t pmask[8] = { 0x3f, 0x30, 0x30, 0x00, 0xc0, 0x03, 0x00, 0x00 };
+	uint8_t pattern[14] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x08, 0x06, 0x00, ARPOP_REQUEST };
 
-					InitSEQ();
-					ack = IncNetNum( tcp->seq, 1 );
+	*(uint32_t*)(pattern+10) = ipaddr;
+	enc28j60_SetPattern( 0, pmask, pattern );
 
-					MakeEthReply( eth );
-					MakeIpReply( ip, (tcpoffset+TCPHDR_SIZE+8)-ETHHDR_SIZE );
-					MakeTcp( tcp, TCP_FLAG_SYN|TCP_FLAG_ACK, 0, ASOCKET_TCP_OPT|ASOCKET_CHECKSUM );
+	UpdateRxFilter();
 
-					DispatchPacket( tcpoffset+TCPHDR_SIZE+8 );
+#ifdef __ASOCK_DBG__
+	Serial.print("aInetStack::setup> hwa ");
+	for (uint8_t i = 0; i < ETH_ALEN ; i++) { Serial.print(hwaddr[i],HEX); Serial.print(':'); }
+	Serial.print(" ip ");
+	Serial.print(ntohl(ipaddr),HEX);
+	Serial.print(" mask ");
+	Serial.print(netmask,DEC);
+	Serial.print(" gw ");
+	Serial.println(ntohl(gatewayip),HEX);
+#endif
+}
 
-					seq = IncNetNum( seq, 1 );
-					constate = ASOCK_ESTABLISHED;
-				break;
+// --------------- socket, segments handed over by the stack
 
-				case ASOCK_ESTABLISHED:
-					if ( tcp->seq != ack || peerport != tcp->source ) break;
+#ifdef ASOCKET_COMPILE_UDP
+// returns 1 when data was queued for the socket
+uint8_t aSocket::HandleUdp( struct ethhdr *eth, struct iphdr *ip, struct udphdr *udp, uint16_t pktlen ) {
 
-					// is it carry proper ack?
-					if (  (tcp->flags & TCP_FLAG_ACK) && tcp->ack_seq == IncNetNum(seq,seq_adv) )
-						seq = tcp->ack_seq;
-					else
-						// no, ignore this packet
-						break;
+	uint16_t datalen = ntohs(udp->len) - UDPHDR_SIZE;
+				
+	#ifdef __ASOCK_DBG_UDP__
+	Serial.print("udp: src ");
+	Serial.print(ntohs(udp->source),DEC);
+	Serial.print(" dst ");
+	Serial.println(ntohs(udp->dest),DEC);
+	Serial.print(" pktlen ");
+	Serial.println(pktlen,DEC);
+	#endif
 
-					MakeEthReply( eth );
-					MakeIpReply( ip, tcpoffset+TCPHDR_SIZE-ETHHDR_SIZE );
+	if ( InetStack.RxChecksum(IPPROTO_UDP,datalen) != udp->check ) return 0;
 
-					if ( tcp->flags & (TCP_FLAG_RST|TCP_FLAG_FIN) ) {
+	if ( !datalen || (constate != ASOCK_ESTABLISHED && constate != ASOCK_LISTEN) ) return 0;
 
-						// send rst
-						if ( tcp->flags & TCP_FLAG_FIN ) {
-							MakeTcp( tcp, TCP_FLAG_RST|TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
-							DispatchPacket( tcpoffset+TCPHDR_SIZE );
-						}
+	if ( constate == ASOCK_LISTEN ) {
+		InetStack.copyhwa(eth->h_source,peerhwaddr);
+		peeripaddr = ip->saddr;
+		peerport = udp->source;
+		constate = ASOCK_ESTABLISHED;
+		InetStack.UpdateRxFilter();
+	}
 
-						constate = ASOCK_CLOSED;
-						break;
-					}
+	if ( availdata+datalen > ASOCKET_RXSHARE ) datalen = ASOCKET_RXSHARE-availdata;
+
+	if ( datalen ) StageIn( enc28j60_RxAddr(enc28j60_ReceivedPktAddr()+pktlen-datalen), datalen );
+
+return 1;
+}
+#endif
+
+#ifdef ASOCKET_COMPILE_TCP
+// returns 1 when an in-sequence segment was taken
+uint8_t aSocket::HandleTcp( struct ethhdr *eth, struct iphdr *ip, struct tcphdr *tcp, uint16_t pktlen ) {
+
+	uint16_t tcpoffset = ((uint8_t*)tcp-(uint8_t*)eth);
+	uint16_t datalen = pktlen - (tcpoffset+TCPHDR_SIZE);
+
+	#ifdef __ASOCK_DBG_TCP__
+	Serial.print("tcp: src ");
+	Serial.print(ntohs(tcp->source),DEC);
+	Serial.print(" dst ");
+	Serial.println(ntohs(tcp->dest),DEC);
+	Serial.print(" flags ");
+	Serial.print(tcp->flags,HEX);
+	Serial.print(" pktlen ");
+	Serial.println(pktlen,DEC);
+	Serial.print(" check ");
+	Serial.print(InetStack.RxChecksum(IPPROTO_TCP,datalen),HEX);
+	Serial.print(' ');
+	Serial.println(tcp->check,HEX);
+	#endif
+
+	if ( InetStack.RxChecksum(IPPROTO_TCP,datalen) != tcp->check ) return 0;
+
+	// now we can proceed
+	switch ( constate ) {
+
+	case ASOCK_INIT:
+		if ( !(tcp->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK)) || tcp->ack_seq != seq || peerport != tcp->source ) break;
+
+		if ( rtton ) RttSample( (uint16_t)millis() - rtttime );
+
+		ack = IncNetNum( tcp->seq, 1 );
+		sndwnd = ntohs(tcp->window);
+		PeerOptions( tcp, tcpoffset );
+
+		// make reply frame (we may need to cut off possible tcp options)
+		InetStack.MakeEthReply( eth );
+		InetStack.MakeIpReply( ip, tcpoffset+TCPHDR_SIZE-ETHHDR_SIZE );
+		MakeTcp( tcp, TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
+
+		InetStack.DispatchPacket( tcpoffset+TCPHDR_SIZE );
+
+		constate = ASOCK_ESTABLISHED;
+	break;
+
+	case ASOCK_LISTEN:
+		if ( tcp->flags != TCP_FLAG_SYN ) break;
+
+		InetStack.copyhwa(eth->h_source,peerhwaddr);
+		peeripaddr = ip->saddr;
+		peerport = tcp->source;
+
+		InitSEQ();
+		ack = IncNetNum( tcp->seq, 1 );
+		sndwnd = ntohs(tcp->window);
+		PeerOptions( tcp, tcpoffset );
+
+		InetStack.MakeEthReply( eth );
+		InetStack.MakeIpReply( ip, (tcpoffset+TCPHDR_SIZE+8)-ETHHDR_SIZE );
+		MakeTcp( tcp, TCP_FLAG_SYN|TCP_FLAG_ACK, 0, ASOCKET_TCP_OPT|ASOCKET_CHECKSUM );
+
+		InetStack.DispatchPacket( tcpoffset+TCPHDR_SIZE+8 );
+
+		seq = IncNetNum( seq, 1 );
+		constate = ASOCK_ESTABLISHED;
+	break;
+
+	case ASOCK_ESTABLISHED:
+		if ( peerport != tcp->source ) break;
 
-					if ( tcp->flags & TCP_FLAG_ACK ) {
+		// A window probe, a duplicate or data out of order is not taken. Unless it is a
+		// reset the ack tells the peer what we expect and how much room there is
+		// (RFC 793, RFC 1122 4.2.2.17), a window update it missed is repeated so.
+		if ( tcp->seq != ack ) {
+
+			if ( tcp->flags & TCP_FLAG_RST ) break;
+
+			// Data beyond a lost segment still brings a valid ack, and so does anything
+			// while our window is closed, the peer's probes may be all that comes then
+			// (RFC 793). The data is dropped, segments out of order are not kept.
+			if ( (tcp->flags & TCP_FLAG_ACK) && ( !RcvWnd() || ntohl(tcp->seq) - ntohl(ack) <= RcvWnd() ) ) TakeAck( tcp );
+
+			InetStack.MakeEthReply( eth );
+			InetStack.MakeIpReply( ip, tcpoffset+TCPHDR_SIZE-ETHHDR_SIZE );
+			MakeTcp( tcp, TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
+			InetStack.DispatchPacket( tcpoffset+TCPHDR_SIZE );
+		break;
+		}
+
+		// is it carry proper ack?
+		if ( !(tcp->flags & TCP_FLAG_ACK) || !TakeAck( tcp ) ) break;
+
+		InetStack.MakeEthReply( eth );
+		InetStack.MakeIpReply( ip, tcpoffset+TCPHDR_SIZE-ETHHDR_SIZE );
+
+		if ( tcp->flags & (TCP_FLAG_RST|TCP_FLAG_FIN) ) {
+
+			// send rst
+			if ( tcp->flags & TCP_FLAG_FIN ) {
+				MakeTcp( tcp, TCP_FLAG_RST|TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
+				InetStack.DispatchPacket( tcpoffset+TCPHDR_SIZE );
+			}
+
+			constate = ASOCK_CLOSED;
+			break;
+		}
+
+		if ( tcp->flags & TCP_FLAG_ACK ) {
 					
-						// we may need to cut off possible tcp options
-						datalen = pktlen - (tcpoffset+(tcp->doff<<2));
+			// we may need to cut off possible tcp options
+			datalen = pktlen - (tcpoffset+(tcp->doff<<2));
 
-						if ( availdata+datalen > RXBUFSIZE ) datalen = RXBUFSIZE-availdata;
+			// send ack if we got any data
+			if ( datalen ) {
 
-						// send ack if we got any data
-						if ( datalen ) {
+				// A segment beyond our window is not taken, not even in part. The ack
+				// repeats what we expect and how much room there is.
+				if ( datalen <= RcvWnd() ) {
 
-							enc28j60_CopyMem( enc28j60_ReceivedPktAddr()+pktlen-datalen, RXBUFFER+availdata, datalen );
-							availdata += datalen;
+					StageIn( enc28j60_RxAddr(enc28j60_ReceivedPktAddr()+pktlen-datalen), datalen );
 
-							ack = IncNetNum( ack, datalen );
+					ack = IncNetNum( ack, datalen );
 
-							MakeTcp( tcp, TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
-							DispatchPacket( tcpoffset+TCPHDR_SIZE );
-						}
+					// The ack may ride on our reply, the stack sends it alone if none comes
+					// soon. Every second segment is acknowledged at once.
+					if ( !ackpend ) {
+						ackpend = 1;
+						acktime = millis();
+					return 1;
 					}
-					
-					enc28j60_FreeReceivedPkt();
-				return;
 				}
+
+				MakeTcp( tcp, TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
+				InetStack.DispatchPacket( tcpoffset+TCPHDR_SIZE );
 			}
-#else
-		{ }
-#endif
 		}
+	return 1;
 
-		enc28j60_FreeReceivedPkt();
+	// no connection to take the segment
+	default:
+	break;
 	}
+
+return 0;
 }
+#endif
 
-// --------------- public members
+// --------------- socket, public members
 
 aSocket::aSocket( ) {
+
+	constate = ASOCK_CLOSED;
+	peeripaddr = INADDR_NONE;
+}
+
+aSocket::~aSocket( ) {
+	InetStack.Detach(this);
 }
 
 void aSocket::setup( uint32_t ip, uint8_t hwa[ETH_ALEN], uint8_t mask, uint32_t gw ) {
 
+	InetStack.Detach(this);
+
 	constate = ASOCK_CLOSED;
+	peeripaddr = INADDR_NONE;
 
-	copyhwa( hwa, hwaddr );
-	ipaddr = ip;
-	netmask = (mask > 32) ? 32 : mask;
-	gatewayip = gw;
+	InetStack.setup( ip, hwa, mask, gw );
+}
 
-	peeripaddr = INADDR_NONE;
+// Appends payload at src in the RX ring to the staging ring, which wraps at the
+// end of the socket's share.
+void aSocket::StageIn( uint16_t src, uint16_t len ) {
 
-#ifdef __ASOCK_DBG__
-	Serial.print("aSocket::setup> hwa ");
-	for (uint8_t i = 0; i < ETH_ALEN ; i++) { Serial.print(hwaddr[i],HEX); Serial.print(':'); }
-	Serial.print(" ip ");
-	Serial.print(ntohl(ipaddr),HEX);
-	Serial.print(" mask ");
-	Serial.print(netmask,DEC);
-	Serial.print(" gw ");
-	Serial.println(ntohl(gatewayip),HEX);
-#endif
+	uint16_t tail = rxhead + availdata;
+	uint16_t part;
+
+	if ( tail >= ASOCKET_RXSHARE ) tail -= ASOCKET_RXSHARE;
+
+	part = ASOCKET_RXSHARE - tail;
+	if ( part > len ) part = len;
+
+	enc28j60_CopyMem( src, rxbuf+tail, part );
+	if ( len > part ) enc28j60_CopyMem( enc28j60_RxAddr(src+part), rxbuf, len-part );
+
+	availdata += len;
 }
 
-uint32_t aSocket::listen( uint16_t portnum, uint8_t prot ) {
+// copies len bytes from the staging ring at offset pos, nothing is moved
+void aSocket::StageRead( uint16_t pos, uint8_t *dst, uint16_t len ) {
+
+	uint16_t part = ASOCKET_RXSHARE - pos;
+
+	if ( part > len ) part = len;
+
+	enc28j60_ReadMem( rxbuf+pos, dst, part );
+	if ( len > part ) enc28j60_ReadMem( rxbuf, dst+part, len-part );
+}
+
+// reset the control block and take a place in the stack
+uint8_t aSocket::Open( uint8_t prot ) {
 
-	port = portnum;
 	protocol = prot;
-	constate = ASOCK_LISTEN;
 
 #ifdef ASOCKET_COMPILE_TCP
 	seq = 0;
 	seq_adv = 0;
 	ack = 0;
+	ackpend = 0;
+	rto = ASOCKET_RTOINIT;
+	srtt = 0;
+	rtton = 0;
 #endif
 	availdata = 0;
+	rxhead = 0;
+	txslot = -1;
+	dataoff = 0;
+	retries = 0;
+
+return InetStack.Attach(this) >= 0;
+}
 
-	while ( constate == ASOCK_LISTEN ) HandleInetStack(ASOCKET_CONTO);
+// next hop hardware address is known, go on with the connection
+void aSocket::Resolved() {
+
+	constate = ASOCK_INIT;
+
+#ifdef ASOCKET_COMPILE_UDP
+	if ( protocol == IPPROTO_UDP ) {
+		constate = ASOCK_ESTABLISHED;
+		return;
+	}
+#endif
+#ifdef ASOCKET_COMPILE_TCP
+	retries = 0;
+	txtime = millis();
+	SendTCPSYN();
+#endif
+}
+
+// retransmits whatever the socket waits an answer for, and gives up after a few tries
+void aSocket::RunTimer() {
+
+	uint16_t timeout = ASOCKET_REQTO;
+
+#ifdef ASOCKET_COMPILE_TCP
+	// nothing was sent to carry the ack
+	if ( ackpend && (uint16_t)((uint16_t)millis() - acktime) >= ASOCKET_ACKDELAY ) SendTCPCtrl( TCP_FLAG_ACK );
+
+	if ( constate != ASOCK_QUERYARP ) timeout = rto;
+#endif
+
+	if ( (uint16_t)((uint16_t)millis() - txtime) < timeout ) return;
+
+	switch ( constate ) {
+
+	case ASOCK_QUERYARP:
+		if ( ++retries < ASOCKET_RETRIES ) {
+			InetStack.QueryARP( InetStack.NextHop(peeripaddr) );
+			break;
+		}
+
+		close();
+	return;
+
+#ifdef ASOCKET_COMPILE_TCP
+	case ASOCK_INIT:
+		if ( ++retries < ASOCKET_RETRIES ) {
+			Backoff();
+			SendTCPSYN();
+			break;
+		}
+
+#ifdef ASOCKET_ARPCACHE
+		// the peer, or the gateway, may have changed its hardware address
+		InetStack.ArpForget( InetStack.NextHop(peeripaddr) );
+#endif
+		close();
+	return;
+
+	case ASOCK_ESTABLISHED:
+		if ( !seq_adv ) return;
+
+		if ( ++retries < ASOCKET_MAXRETRANS ) {
+			// no ack received, the oldest segment still sits in its TX slot
+			Backoff();
+			enc28j60_TxSlot( InetStack.TxOldest( this ) );
+			PatchTcp();
+			enc28j60_SendNewPacket();
+			break;
+		}
+
+		// nothing to wait for in close()
+		seq_adv = 0;
+		close();
+	return;
+#endif
+
+	default:
+	return;
+	}
+
+	txtime = millis();
+}
+
+uint8_t aSocket::listen_nb( uint16_t portnum, uint8_t prot ) {
+
+	port = portnum;
+
+	// all sockets are in use
+	if ( !Open( prot ) ) return 1;
+
+	constate = ASOCK_LISTEN;
+	InetStack.UpdateRxFilter();
+
+return 0;
+}
+
+uint32_t aSocket::listen( uint16_t portnum, uint8_t prot ) {
+
+	if ( listen_nb( portnum, prot ) ) return INADDR_NONE;
+
+	while ( constate == ASOCK_LISTEN ) InetStack.HandleInetStack(ASOCKET_CONTO, this);
 
 	if ( constate != ASOCK_ESTABLISHED ) close();
 
 return peeripaddr;
 }
 
-uint8_t aSocket::connect( uint32_t ip, uint16_t portnum, uint8_t prot ) {
+uint8_t aSocket::connect_nb( uint32_t ip, uint16_t portnum, uint8_t prot ) {
 
 	peerport = portnum;
-	protocol = prot;
 
 	// ports below 1024 are reserved
 	port = rand();
 	port = htons((port < 1024) ? port + 1024 : port);
 
-#ifdef ASOCKET_COMPILE_TCP
-	seq = 0;
-	seq_adv = 0;
-	ack = 0;
+	if ( !Open( prot ) ) return 1;
+
+	peeripaddr = ip;
+
+#ifdef ASOCKET_ARPCACHE
+	if ( InetStack.ArpLookup( InetStack.NextHop(peeripaddr), peerhwaddr ) ) {
+		Resolved();
+		return 0;
+	}
 #endif
-	availdata = 0;
+
 	constate = ASOCK_QUERYARP;
+	txtime = millis();
+	InetStack.QueryARP( InetStack.NextHop(peeripaddr) );
 
-	while ( 1 ) {
+return 0;
+}
 
-		// while doing assignment here we will optimize code size
-		peeripaddr = ip;
+uint8_t aSocket::connect( uint32_t ip, uint16_t portnum, uint8_t prot ) {
 
-		switch ( constate ) {
+	if ( connect_nb( ip, portnum, prot ) ) return 1;
 
-		case ASOCK_QUERYARP:
+	// retries are made by the stack, it closes the socket when they run out
+	while ( constate == ASOCK_QUERYARP || constate == ASOCK_INIT ) InetStack.HandleInetStack(ASOCKET_REQTO, this);
 
-			// do we need to use gateway?
-			if ( subnet(ipaddr) != subnet(peeripaddr) ) peeripaddr = gatewayip;
+	if ( constate == ASOCK_ESTABLISHED ) return 0;
 
-			for ( uint8_t counter = 0 ; counter < ASOCKET_RETRIES && constate == ASOCK_QUERYARP ; counter++ ) {
+	close();
 
-				QueryARP();
-				HandleInetStack(ASOCKET_REQTO);
-			}
+return 1;
+}
 
-			if ( constate == ASOCK_QUERYARP ) constate = ASOCK_CLOSED;
+uint8_t aSocket::poll() {
 
-		break;
+	uint8_t events = 0;
 
-		case ASOCK_INIT:
-#ifdef ASOCKET_COMPILE_UDP
-			if ( protocol == IPPROTO_UDP ) {
-				constate = ASOCK_ESTABLISHED;
-				break;
-			}
-#endif
-#ifdef ASOCKET_COMPILE_TCP
-			for ( uint8_t counter = 0 ; counter < ASOCKET_RETRIES && constate == ASOCK_INIT ; counter++ ) {
+	if ( availdata ) events |= ASOCKET_READABLE;
 
-				SendTCPSYN();
-				HandleInetStack(ASOCKET_REQTO);
-			}
+	if ( constate == ASOCK_ESTABLISHED ) {
 
-			if ( constate == ASOCK_INIT ) constate = ASOCK_CLOSED;
-
-		break;
+		// a frame is being built or there is a TX slot for one
+		if ( txslot >= 0 || InetStack.TxFree() >= 0 ) events |= ASOCKET_WRITABLE;
+#ifdef ASOCKET_COMPILE_TCP
+		// and the peer can take more
+		if ( protocol == IPPROTO_TCP && seq_adv >= sndwnd ) events &= ~ASOCKET_WRITABLE;
 #endif
-		case ASOCK_ESTABLISHED:
-		return 0;
+	} else if ( constate == ASOCK_CLOSED ) events |= ASOCKET_CLOSED;
 
-		case ASOCK_CLOSED:
-			close();
-		return 1;
-		}
-	}
-
-return 1;
+return events;
 }
 
 uint16_t aSocket::available() {
 
-	HandleInetStack(1);
+	InetStack.HandleInetStack(0, this);
 
-	if ( constate != ASOCK_ESTABLISHED ) close();
+	// a connection still being set up by listen_nb() or connect_nb() is left alone
+	if ( constate == ASOCK_CLOSED ) close();
 
 return availdata;
 }
 
+uint16_t aSocket::peek( uint8_t *dst, uint16_t len ) {
+
+	// invoking available() will read possible pendings
+	if ( len > available() ) len = availdata;
+
+	if ( len ) StageRead( rxhead, dst, len );
+
+return len;
+}
+
+void aSocket::consume( uint16_t len ) {
+
+	if ( len > availdata ) len = availdata;
+
+	availdata -= len;
+
+	// start over at the front when empty, it saves split transfers
+	if ( !availdata )
+		rxhead = 0;
+	else if ( (rxhead += len) >= ASOCKET_RXSHARE )
+		rxhead -= ASOCKET_RXSHARE;
+
+#ifdef ASOCKET_COMPILE_TCP
+	// Window update once reading opens it by a full segment, which keeps the peer
+	// from trickling small ones.
+	if ( protocol == IPPROTO_TCP && constate == ASOCK_ESTABLISHED
+			&& (int16_t)(RcvWnd() - rcvadv) >= ASOCKET_RCVMSS ) SendTCPCtrl( TCP_FLAG_ACK );
+#endif
+}
+
+uint16_t aSocket::read( uint8_t *dst, uint16_t len ) {
+
+	len = peek( dst, len );
+	consume( len );
+
+return len;
+}
+
 uint8_t* aSocket::read( uint16_t *datasize ) {
 
-	if ( *datasize > ASOCKET_BUFSIZE ) *datasize = ASOCKET_BUFSIZE;
+	uint16_t pos;
+
+	// room is left for the terminating zero
+	if ( *datasize > ASOCKET_BUFSIZE-1 ) *datasize = ASOCKET_BUFSIZE-1;
 
 	// invoking available() will read possible pendings
 	if ( *datasize > available() ) *datasize = availdata;
 
 	if ( *datasize ) {
-	
-		enc28j60_ReadMem( RXBUFFER, pktbuf, *datasize );
 
-		availdata -= *datasize;
-		if ( availdata ) enc28j60_CopyMem( RXBUFFER+*datasize, RXBUFFER, availdata );
-		
-	return pktbuf;
+		// a window update goes out through pktbuf, so the data is taken after it
+		pos = rxhead;
+		consume( *datasize );
+		StageRead( pos, InetStack.pktbuf, *datasize );
+		InetStack.pktbuf[*datasize] = '\0';
+
+	return InetStack.pktbuf;
 	}
 
 return NULL;
 }
 
-uint16_t aSocket::write( uint8_t *data, uint16_t datasize, uint8_t flags ) {
+// Selects the TX slot of the data frame being built, starting one if needed,
+// and returns how much more data fits into it.
+uint16_t aSocket::FrameRoom() {
 
-	static uint16_t dataoff = 0;
+	uint16_t hdrsize = ETHHDR_SIZE + IPHDR_SIZE + ((protocol == IPPROTO_TCP) ? TCPHDR_SIZE : UDPHDR_SIZE);
+	uint16_t room;
 
-	if ( constate != ASOCK_ESTABLISHED ) return 0;
-	
-	if ( !dataoff ) {
+	if ( txslot < 0 ) {
 	
 		// create new packet
-		dataoff = ETHHDR_SIZE + IPHDR_SIZE + ((protocol == IPPROTO_TCP) ? TCPHDR_SIZE : UDPHDR_SIZE);
+		txslot = InetStack.TxAlloc( this );
+		dataoff = hdrsize;
+
+#ifdef ENC28J60_STATS
+		enc28j60_GetStats( &txsnap );
+#endif
+
+		enc28j60_TxSlot( txslot );
 		enc28j60_NewPacket( dataoff );
+	} else {
+#ifdef ENC28J60_STATS
+		// the cost so far turns back into a snapshot, see FramePause()
+		enc28j60_StatsDelta( &txsnap );
+#endif
+		enc28j60_TxSlot( txslot );
+	}
+
+	room = ETH_FRAME_LEN - dataoff;
+
+#ifdef ASOCKET_COMPILE_TCP
+	// segments as large as the peer takes, within its window
+	if ( protocol == IPPROTO_TCP ) {
+
+		uint16_t payload = dataoff - hdrsize;
+		uint16_t wnd = ( sndwnd > seq_adv + payload ) ? sndwnd - seq_adv - payload : 0;
+
+		if ( wnd < room ) room = wnd;
+		if ( sndmss - payload < room ) room = sndmss - payload;
+	}
+#endif
+
+return room;
+}
+
+// The data frame waits for more data. Whatever goes over SPI until the next piece,
+// received frames and control frames sent, is not its cost. The snapshot is turned
+// into the cost so far, FrameRoom() turns it back.
+void aSocket::FramePause() {
+
+#ifdef ENC28J60_STATS
+	enc28j60_StatsDelta( &txsnap );
+#endif
+}
+
+#ifdef ENC28J60_SPISUM
+#define FRAMESUM	ASOCKET_SPISUM
+#else
+#define FRAMESUM	ASOCKET_NOFLAGS		// summed on chip below
+#endif
+
+// Puts the headers in front of the data frame being built and sends it.
+void aSocket::FrameSend() {
+
+	uint8_t *pktbuf = InetStack.pktbuf;
+	struct iphdr *ip = (struct iphdr*)(pktbuf+ETHHDR_SIZE);
+	uint16_t hdrsize = ETHHDR_SIZE + IPHDR_SIZE + ((protocol == IPPROTO_TCP) ? TCPHDR_SIZE : UDPHDR_SIZE);
+	uint16_t datalen = dataoff - hdrsize;
+
+	// When the slot still holds this connection's headers from an earlier frame, the
+	// Ethernet header and the IP addresses there stay as they are.
+	uint8_t reuse = ( InetStack.txq[txslot].hdr == this );
+
+	if ( reuse )
+		PatchIp( ip, dataoff-ETHHDR_SIZE );
+	else {
+		MakeEth( (struct ethhdr*)pktbuf, ETH_P_IP );
+		MakeIp( ip, dataoff-ETHHDR_SIZE, protocol );
 	}
 
+	iptot_len = ip->tot_len;
+	ipid = ip->id;
+	ipcheck = ip->check;
+
+	if ( protocol == IPPROTO_TCP ) {
+#ifdef ASOCKET_COMPILE_TCP
+		MakeTcp( (struct tcphdr*)(pktbuf+ETHHDR_SIZE+IPHDR_SIZE), TCP_FLAG_PSH|TCP_FLAG_ACK, datalen, FRAMESUM );
+#endif
+	} else {
+#ifdef ASOCKET_COMPILE_UDP
+		MakeUdp( (struct udphdr*)(pktbuf+ETHHDR_SIZE+IPHDR_SIZE), datalen, FRAMESUM );
+#endif
+	}
+
+	if ( reuse ) {
+		// tot_len up to the IP checksum, then the transport header
+		enc28j60_WritePacketData( memoff(ETHHDR_SIZE,struct iphdr,tot_len), (uint8_t*)&ip->tot_len, memoff(0,struct iphdr,saddr)-memoff(0,struct iphdr,tot_len), 0 );
+		enc28j60_WritePacketData( ETHHDR_SIZE+IPHDR_SIZE, pktbuf+ETHHDR_SIZE+IPHDR_SIZE, hdrsize-(ETHHDR_SIZE+IPHDR_SIZE), 0 );
+	} else
+		enc28j60_WritePacketData( 0, pktbuf, hdrsize, 0 );
+
+	InetStack.txq[txslot].hdr = this;
+
+#ifndef ENC28J60_SPISUM
+	InetStack.OnChipChecksum( enc28j60_NewPktAddr(), protocol, datalen );
+#endif
+	enc28j60_SendNewPacket();
+
+#ifdef ENC28J60_STATS
+	InetStack.txcost = txsnap;
+	enc28j60_StatsDelta( &InetStack.txcost );
+#endif
+
+#ifdef ASOCKET_COMPILE_TCP
+	if ( protocol == IPPROTO_TCP && datalen ) {
+
+		// keep the segment in its slot for retransmission until it is acknowledged
+		InetStack.txq[txslot].end = ntohl(seq) + seq_adv + datalen;
+
+		// one segment at a time is timed
+		if ( !rtton ) {
+			rtton = 1;
+			rtttime = millis();
+			rttseq = InetStack.txq[txslot].end;
+		}
+
+		if ( !seq_adv ) {
+			retries = 0;
+			txtime = millis();
+		}
+
+		seq_adv += datalen;
+		txslot = -1;
+		dataoff = 0;
+	return;
+	}
+#endif
+
+	InetStack.txq[txslot].owner = NULL;
+	txslot = -1;
+	dataoff = 0;
+}
+
+uint16_t aSocket::write_nb( uint8_t *data, uint16_t datasize, uint8_t flags ) {
+
+	uint16_t room;
+
+	if ( !(poll() & ASOCKET_WRITABLE) ) return 0;
+
+	room = FrameRoom();
+
 	// adjust packet size
-	if ( (dataoff+datasize) > MAX_FRAMELEN ) {
-		datasize = MAX_FRAMELEN - dataoff;
+	if ( datasize > room ) {
+		datasize = room;
 
 		// packet oversized, send it immediately
 		flags &= ~ASOCKET_MORE_DATA;
@@ -700,76 +1660,119 @@ uint16_t aSocket::write( uint8_t *data, uint16_t datasize, uint8_t flags ) {
 	}
 
 	// wait for more data
-	if ( flags & ASOCKET_MORE_DATA ) return datasize;
-	
-	MakeEth( (struct ethhdr*)pktbuf, ETH_P_IP );
-	MakeIp( (struct iphdr*)(pktbuf+ETHHDR_SIZE), dataoff-ETHHDR_SIZE, protocol );
-	
-	uint16_t datalen;
+	if ( !(flags & ASOCKET_MORE_DATA) ) FrameSend();
+	else FramePause();
+
+return datasize;
+}
+
+// Waits until acks free a TX slot or open the peer's window, ASOCKET_CONTO at most.
+// A window closed with nothing in flight brings no ack to open it, the window update
+// may have been lost, so it is probed with growing intervals.
+void aSocket::WaitWritable() {
 
-	if ( protocol == IPPROTO_TCP ) {
 #ifdef ASOCKET_COMPILE_TCP
-		datalen = dataoff - ETHHDR_SIZE - IPHDR_SIZE - TCPHDR_SIZE;
+	uint32_t m = millis();
+	uint16_t probed = m;
+	uint16_t wait = rto;
 
-		MakeTcp( (struct tcphdr*)(pktbuf+ETHHDR_SIZE+IPHDR_SIZE), TCP_FLAG_PSH|TCP_FLAG_ACK, datalen, ASOCKET_NOFLAGS );
-		enc28j60_WritePacketData(0,pktbuf,ETHHDR_SIZE+IPHDR_SIZE+TCPHDR_SIZE, 0 );
-#endif
-	} else {
-#ifdef ASOCKET_COMPILE_UDP
-		datalen = dataoff - ETHHDR_SIZE - IPHDR_SIZE - UDPHDR_SIZE;
+	while ( protocol == IPPROTO_TCP && constate == ASOCK_ESTABLISHED && !(poll() & ASOCKET_WRITABLE)
+			&& millis() - m < ASOCKET_CONTO ) {
 
-		MakeUdp( (struct udphdr*)(pktbuf+ETHHDR_SIZE+IPHDR_SIZE), datalen, ASOCKET_NOFLAGS );
-		enc28j60_WritePacketData(0,pktbuf,ETHHDR_SIZE+IPHDR_SIZE+UDPHDR_SIZE, 0 );
-#endif
+		if ( !seq_adv && !sndwnd && (uint16_t)((uint16_t)millis() - probed) >= wait ) {
+			SendTCPProbe();
+			probed = millis();
+			wait = ( wait < ASOCKET_RTOMAX/2 ) ? wait << 1 : ASOCKET_RTOMAX;
+		}
+
+		InetStack.HandleInetStack( seq_adv ? ASOCKET_REQTO : wait, this );
 	}
+#endif
+}
 
-	OnChipChecksum( enc28j60_NewPktAddr(), protocol, datalen );
-	seq_adv = datalen;
+uint16_t aSocket::writev( const struct aiovec *iov, uint8_t iovcnt, uint8_t flags ) {
 
-	uint8_t counter = 0;
-	for ( ; counter < ASOCKET_RETRIES && constate == ASOCK_ESTABLISHED ; counter++ ) {
+	uint16_t written = 0;
+	uint16_t done = 0;		// part of *iov already written
 
-		enc28j60_SendNewPacket();
+	while ( iovcnt ) {
 
-		if ( protocol == IPPROTO_TCP ) {
-#ifdef ASOCKET_COMPILE_TCP
+		WaitWritable();
+		if ( !(poll() & ASOCKET_WRITABLE) ) break;
 
-			uint32_t initialseq = seq;
-			HandleInetStack(ASOCKET_REQTO);		// wait for ack
+		uint16_t room = FrameRoom();
 
-			if ( seq == IncNetNum(initialseq,seq_adv) ) break;
-			
-			// no ack received, loop back for retransmission
-#endif
-		} else {
-#ifdef ASOCKET_COMPILE_UDP
-			break;
+		// the pieces of a frame go out in one SPI write command
+		enc28j60_StreamBegin( dataoff );
+
+		while ( iovcnt && room ) {
+
+			uint16_t len = iov->len - done;
+
+			if ( len > room ) len = room;
+
+#ifdef ENC28J60_SPISUM
+			// a whole piece with a known sum is not summed again
+			if ( (iov->flags & ASOCKET_SUMMED) && len == iov->len )
+				enc28j60_StreamSummed( (uint8_t*)iov->data, len, (iov->flags&ASOCKET_PGM_DATA), iov->sum );
+			else
 #endif
+			enc28j60_StreamData( (uint8_t*)iov->data + done, len, (iov->flags&ASOCKET_PGM_DATA) );
+
+			dataoff += len;
+			written += len;
+			room -= len;
+			done += len;
+
+			if ( done == iov->len ) {
+				iov++;
+				iovcnt--;
+				done = 0;
+			}
 		}
-	}
 
-	dataoff = 0;
-	seq_adv = 0;
+		enc28j60_StreamEnd();
+		enc28j60_SetNewPacketLen( dataoff );
 
-	if ( constate != ASOCK_ESTABLISHED || counter == ASOCKET_RETRIES ) {
-		close();
+		// full frames go at once, the last one may wait for more data
+		if ( !room || !(flags & ASOCKET_MORE_DATA) ) FrameSend();
+		else FramePause();
 	}
 
+	if ( constate != ASOCK_ESTABLISHED ) close();
+
+return written;
+}
+
+uint16_t aSocket::write( uint8_t *data, uint16_t datasize, uint8_t flags ) {
+
+	WaitWritable();
+
+	datasize = write_nb( data, datasize, flags );
+
+	if ( constate != ASOCK_ESTABLISHED ) close();
+
 return datasize;
 }
 
 void aSocket::close() {
 #ifdef ASOCKET_COMPILE_TCP
+	// let the segments in flight get through, retransmissions are made by the stack
+	while ( seq_adv && constate == ASOCK_ESTABLISHED ) InetStack.HandleInetStack(ASOCKET_REQTO, this);
+
 	if ( constate == ASOCK_ESTABLISHED && protocol == IPPROTO_TCP ) {
 
 		// send RST
-		MakeEth( (struct ethhdr*)pktbuf, ETH_P_IP );
-		MakeIp( (struct iphdr*)(pktbuf+ETHHDR_SIZE), IPHDR_SIZE+TCPHDR_SIZE, IPPROTO_TCP );
-		MakeTcp( (struct tcphdr*)(pktbuf+ETHHDR_SIZE+IPHDR_SIZE), TCP_FLAG_RST|TCP_FLAG_ACK, 0, ASOCKET_CHECKSUM );
-		DispatchPacket( ETHHDR_SIZE+IPHDR_SIZE+TCPHDR_SIZE );
+		SendTCPCtrl( TCP_FLAG_RST|TCP_FLAG_ACK );
 	}
 #endif
 	constate = ASOCK_CLOSED;
 	peeripaddr = INADDR_NONE;
 	peerport = 0;
-}
\ No newline at end of file
+	dataoff = 0;
+#ifdef ASOCKET_COMPILE_TCP
+	seq_adv = 0;
+#endif
+
+	InetStack.Detach(this);
+}
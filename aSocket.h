@@ -23,12 +23,38 @@
 #define ASOCKET_CONTO		30000		// time out for whole connection
 #define ASOCKET_REQTO		3000			// time out for various requests
 #define ASOCKET_RETRIES	3
+#define ASOCKET_ACKDELAY	100			// how long an ack waits for data to ride on
+
+// TCP retransmission timeout follows the measured round trip time (RFC 6298)
+#define ASOCKET_RTOINIT	1000			// until the first RTT sample
+#define ASOCKET_RTOMIN		200
+#define ASOCKET_RTOMAX		60000
+#define ASOCKET_MAXRETRANS	6			// data retransmissions before a connection is given up
+
+#define ASOCKET_MAXSOCKS	3			// sockets open at the same time
+#define ASOCKET_RXSHARE	(RXBUFSIZE/ASOCKET_MAXSOCKS)	// RX staging space of each socket, rxstage of enc28j60_Layout()
+#define ASOCKET_MSS		((uint16_t)(ETH_DATA_LEN-IPHDR_SIZE-TCPHDR_SIZE))	// largest segment ethernet carries
+#define ASOCKET_MINMSS		64			// smallest segment we send, whatever the peer announces
+// MSS we announce, two segments must fit the window
+#define ASOCKET_RCVMSS	((ASOCKET_RXSHARE/2 < ASOCKET_MSS) ? ASOCKET_RXSHARE/2 : ASOCKET_MSS)
+// received data up to this size is checksummed over SPI, longer by the chip's DMA
+#define ASOCKET_SPISUMMAX	256
+
+#define ASOCKET_ARPCACHE	4			// ARP cache entries, comment out to query on every connect
+#define ASOCKET_ARPAGE		300			// ARP cache entry life time in seconds
 
 #define ASOCKET_NOFLAGS		0x0
 #define ASOCKET_PGM_DATA	0x1
 #define ASOCKET_MORE_DATA	0x2
 #define ASOCKET_TCP_OPT		0x4
 #define ASOCKET_CHECKSUM	0x8
+#define ASOCKET_SPISUM		0x10		// data sum comes from the driver, see ENC28J60_SPISUM
+#define ASOCKET_SUMMED		0x20		// aiovec piece comes with its precomputed sum
+
+// aSocket::poll() results
+#define ASOCKET_READABLE	0x1			// received data waits in available()
+#define ASOCKET_WRITABLE	0x2			// write_nb() will take data
+#define ASOCKET_CLOSED		0x4			// connection is gone, close() frees the socket
 
 #include <inttypes.h>
 #include <avr/pgmspace.h>
@@ -38,6 +64,11 @@ extern "C" {
 	#include "enc28j60.h"
 }
 
+// the driver accepts no smaller RX staging area than ENC28J60_MINSTAGE
+#if ENC28J60_MINSTAGE/ASOCKET_MAXSOCKS < 128
+#error "the smallest RX staging area must leave each socket 128 bytes"
+#endif
+
 //#define __ASOCK_DBG__
 //#define __ASOCK_DBG_ETH__
 //#define __ASOCK_DBG_ARP__
@@ -54,16 +85,115 @@ typedef enum constate_e {
 		ASOCK_CLOSED
 } constate_t;
 
-class aSocket {
+// one piece of aSocket::writev() data
+struct aiovec {
+	const void	*data;
+	uint16_t	len;
+	uint8_t		flags;			// ASOCKET_PGM_DATA when data is in flash, ASOCKET_SUMMED when sum is set
+	uint16_t	sum;			// ones-complement sum of data, made at build time by pgmsum.py
+};
+
+class aSocket;
+
+// Network interface shared by all sockets. It owns the chip, receives every
+// frame once, answers ARP and ICMP itself and hands TCP and UDP segments to
+// the open socket they belong to.
+class aInetStack {
+
+	friend class aSocket;
 
-	// transmission control block, all of those data are in network order (big endian)
 	uint8_t		hwaddr[ETH_ALEN];
 	uint32_t	ipaddr;
 	uint8_t		netmask;
-	uint16_t	port;
-
 	uint32_t	gatewayip;
 
+	aSocket		*socks[ASOCKET_MAXSOCKS];
+
+	// TX slots, each holds a frame being built or a TCP segment waiting for its ack
+	struct txseg {
+		aSocket		*owner;			// NULL when the slot is free
+		uint32_t	end;			// sequence number following the segment, host order
+		aSocket		*hdr;			// whose frame headers the slot holds, they serve the next frame
+	} txq[ENC28J60_MAXTXSLOTS];
+
+	// frame headers, shared by all sockets
+	uint8_t		pktbuf[ASOCKET_BUFSIZE];
+
+#ifdef ASOCKET_ARPCACHE
+	struct arpentry {
+		uint32_t	ipaddr;
+		uint8_t		hwaddr[ETH_ALEN];
+		uint16_t	time;			// when learned, in 1024 ms ticks
+	} arpcache[ASOCKET_ARPCACHE];
+#endif
+
+#ifdef ENC28J60_STATS
+	struct enc28j60_stats	rxsnap;
+	struct enc28j60_stats	rxcost;		// SPI cost of the last received frame, replies included
+	struct enc28j60_stats	txcost;		// SPI cost of the last sent frame
+#endif
+
+	void MakeEthReply( struct ethhdr *eth );
+	void MakeIpReply( struct iphdr *ip, uint16_t tot_len );
+
+	uint16_t OnChipChecksum( uint16_t pktaddr, uint8_t prot, uint16_t datalen );
+	uint16_t RxChecksum( uint8_t prot, uint16_t datalen );
+	void DispatchPacket( uint16_t pktlen );
+	void FreeReceivedPkt();
+
+	void copyhwa( uint8_t *srchwa, uint8_t *dsthwa );
+	uint32_t subnet( uint32_t ip );
+	uint32_t NextHop( uint32_t ip );
+	uint8_t Broadcast( uint32_t ip );
+
+	void QueryARP( uint32_t ip );
+#ifdef ASOCKET_ARPCACHE
+	void ArpLearn( uint32_t ip, uint8_t *hwa );
+	uint8_t ArpLookup( uint32_t ip, uint8_t *hwa );
+	void ArpForget( uint32_t ip );
+#endif
+
+	int8_t Attach( aSocket *sock );
+	void Detach( aSocket *sock );
+	aSocket* FindSocket( uint8_t prot, uint16_t port, uint32_t peerip, uint16_t peerport );
+	void UpdateRxFilter();
+
+	int8_t TxFree();
+	int8_t TxAlloc( aSocket *sock );
+#ifdef ASOCKET_COMPILE_TCP
+	void TxRelease( aSocket *sock );
+	uint8_t TxOldest( aSocket *sock );
+#endif
+
+	// Receive and handle frames and run the retry timers of all sockets. Returns after
+	// timeout ms, or as soon as the waiting socket changed state or got a segment.
+	// With no timeout it returns once nothing is pending.
+	void HandleInetStack( uint32_t timeout, aSocket *waiter );
+
+public:
+	aInetStack( void );
+
+	void setup( uint32_t ip, uint8_t hwa[ETH_ALEN], uint8_t mask, uint32_t gw );
+
+	// Service call for the non-blocking socket API, call it often from loop().
+	// Handles whatever is pending without waiting.
+	void poll() { HandleInetStack( 0, NULL ); }
+
+#ifdef ENC28J60_STATS
+	const struct enc28j60_stats* rxstats() { return &rxcost; }
+	const struct enc28j60_stats* txstats() { return &txcost; }
+#endif
+};
+
+extern aInetStack InetStack;
+
+class aSocket {
+
+	friend class aInetStack;
+
+	// transmission control block, all of those data are in network order (big endian)
+	uint16_t	port;
+
 	uint8_t		peerhwaddr[ETH_ALEN];
 	uint32_t	peeripaddr;
 	uint16_t	peerport;
@@ -72,58 +202,126 @@ class aSocket {
 	constate_t	constate;
 
 #ifdef ASOCKET_COMPILE_TCP
-	uint32_t	seq;
-	uint16_t	seq_adv;		// expected advance for seq number
+	uint32_t	seq;			// oldest unacknowledged
+	uint16_t	seq_adv;		// bytes sent and not acknowledged yet
 	uint32_t	ack;
+	uint16_t	sndwnd;			// peer's receive window, host order
+	uint16_t	sndmss;			// largest segment the peer takes
+	uint16_t	rcvadv;			// receive window we advertised last, host order
+	uint8_t		ackpend;		// received data not acknowledged yet
+	uint16_t	acktime;
+
+	uint16_t	rto;			// retransmission timeout, ms
+	uint16_t	srtt;			// smoothed round trip time, 0 until sampled
+	uint16_t	rttvar;
+	uint8_t		rtton;			// a segment is being timed
+	uint16_t	rtttime;		// when it was sent
+	uint32_t	rttseq;			// the ack which ends it, host order
 #endif
 
+	uint16_t	rxbuf;			// this socket's part of the RX staging buffer, used as a ring
+	uint16_t	rxhead;			// offset of the oldest byte in it
 	uint16_t	availdata;
-	uint8_t		pktbuf[ASOCKET_BUFSIZE];
+	int8_t		txslot;			// TX slot of the data frame being built, -1 if none
+	uint16_t	dataoff;		// end of the data frame being built
+	uint16_t	iptot_len;		// IP fields of the last data frame sent, network order,
+	uint16_t	ipid;			// the next one in a slot holding our headers is patched from them
+	uint16_t	ipcheck;
+#ifdef ENC28J60_STATS
+	struct enc28j60_stats	txsnap;	// counters when the data frame was started, its cost while it waits
+#endif
 
-	void MakeEthReply( struct ethhdr *eth );
-	void MakeIpReply( struct iphdr *ip, uint16_t tot_len );
+	uint16_t	txtime;			// when the frame waiting for an answer was sent
+	uint8_t		retries;
+
+	uint16_t FrameRoom();
+	void FrameSend();
+	void FramePause();
+	void WaitWritable();
 
 	void MakeEth( struct ethhdr *eth, uint16_t h_proto );
 	void MakeIp( struct iphdr *ip, uint16_t tot_len, uint8_t protocol );
+	void PatchIp( struct iphdr *ip, uint16_t tot_len );
 
 #ifdef ASOCKET_COMPILE_TCP
 	void MakeTcp( struct tcphdr *tcp, uint8_t tcpflags, uint16_t datalen, uint8_t flags );
 
 	void InitSEQ();
-	uint32_t IncNetNum( uint32_t &num, uint16_t addval );
+	uint32_t IncNetNum( uint32_t num, uint16_t addval );
 	void SendTCPSYN();
+	void SendTCPCtrl( uint8_t tcpflags );
+	void SendTCPProbe();
+	void PatchTcp();
+	void PeerOptions( struct tcphdr *tcp, uint16_t tcpoffset );
+	uint8_t TakeAck( struct tcphdr *tcp );
+	void RttSample( uint16_t rtt );
+	void SetRto();
+	void Backoff();
+	uint16_t RcvWnd() { return ASOCKET_RXSHARE - availdata; }
+
+	uint8_t HandleTcp( struct ethhdr *eth, struct iphdr *ip, struct tcphdr *tcp, uint16_t pktlen );
 #endif
 
 #ifdef ASOCKET_COMPILE_UDP
 	void MakeUdp( struct udphdr *udp, uint16_t datalen, uint8_t flags );
-#endif
 
-	uint16_t OnChipChecksum( uint16_t pktaddr, uint8_t prot, uint16_t datalen );
-	void DispatchPacket( uint16_t pktlen );
-
-	void copyhwa( uint8_t *srchwa, uint8_t *dsthwa );
-	uint32_t subnet( uint32_t ip );
+	uint8_t HandleUdp( struct ethhdr *eth, struct iphdr *ip, struct udphdr *udp, uint16_t pktlen );
+#endif
 
-	void QueryARP();
+	void StageIn( uint16_t src, uint16_t len );
+	void StageRead( uint16_t pos, uint8_t *dst, uint16_t len );
 
-	void HandleInetStack( uint32_t timeout );
+	uint8_t Open( uint8_t prot );
+	void Resolved();
+	void RunTimer();
 
 public:
     aSocket( void );
+	~aSocket( void );
 
 	constate_t state() { return constate; }
 
+	// sets up the shared InetStack, kept for sketches written for a single socket
 	void setup( uint32_t ip, uint8_t hwa[ETH_ALEN], uint8_t mask, uint32_t gw );
 
 	uint32_t listen( uint16_t portnum, uint8_t prot );
 	uint8_t connect( uint32_t ip, uint16_t portnum, uint8_t prot );
 
-	void flush() { availdata = 0; }
+	// Non-blocking variants, they start the operation and return at once (0 on success).
+	// InetStack.poll() drives them, poll() tells how far they got.
+	uint8_t listen_nb( uint16_t portnum, uint8_t prot );
+	uint8_t connect_nb( uint32_t ip, uint16_t portnum, uint8_t prot );
+	uint8_t poll();
+
+	void flush() { availdata = 0; rxhead = 0; }
 	uint16_t available();
+
+	// returned data lives in the stack's shared buffer, zero terminated, valid until the next socket call
 	uint8_t* read( uint16_t *datasize );
+
+	// Received data goes straight from the chip to dst, any length in one SPI burst.
+	// peek() leaves it in place, consume() drops it.
+	uint16_t read( uint8_t *dst, uint16_t len );
+	uint16_t peek( uint8_t *dst, uint16_t len );
+	void consume( uint16_t len );
 	uint16_t write( uint8_t *data, uint16_t datasize, uint8_t flags );
 
+	// Takes nothing and returns 0 unless the socket is ASOCKET_WRITABLE. Up to TXSLOTS
+	// TCP segments may wait for their ack, the stack retransmits them from the chip.
+	uint16_t write_nb( uint8_t *data, uint16_t datasize, uint8_t flags );
+
+	// Gathers iovcnt segments, RAM or flash each, into frames in one SPI stream per frame.
+	// Full frames are sent as they fill, the last one is kept with ASOCKET_MORE_DATA.
+	// Waits for TX slots like write(), returns the number of bytes taken.
+	uint16_t writev( const struct aiovec *iov, uint8_t iovcnt, uint8_t flags );
+
+	// waits for the ack of segments still in flight
 	void close();
+
+#ifdef ENC28J60_STATS
+	const struct enc28j60_stats* rxstats() { return InetStack.rxstats(); }
+	const struct enc28j60_stats* txstats() { return InetStack.txstats(); }
+#endif
 };
 
 #endif * __ASOCKET_H__ */
\ No newline at end of file
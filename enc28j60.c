@@ -21,6 +21,40 @@
 static uint8_t Enc28j60Bank;
 static uint16_t NextPacketPtr;
 
+// frames known to be in the RX ring, EPKTCNT is read again only when they are gone
+static uint8_t Enc28j60RxBatch;
+
+// interrupt driven reception, see enc28j60_AttachIRQ()
+static uint8_t Enc28j60Irq = ENC28J60_NOIRQ;
+static volatile uint8_t Enc28j60RxPending;
+static uint16_t Enc28j60PollTime;
+
+// buffer memory layout in use, see enc28j60_Layout()
+uint16_t Enc28j60RxStage = ENC28J60_DEFSTAGE;
+uint8_t Enc28j60TxSlots = ENC28J60_DEFTXSLOTS;
+// layout taken by the next enc28j60Init(), the chip keeps the old one until then
+static struct enc28j60_layout Enc28j60Layout = { ENC28J60_DEFSTAGE, ENC28J60_DEFTXSLOTS };
+
+// ETXST as last written, frames sent from the same place don't set it again
+static uint16_t Enc28j60TxStartAddr;
+// the frame at Enc28j60TxStartAddr may still be on the wire, its TXIF is not seen yet
+static uint8_t Enc28j60TxPending;
+
+static void enc28j60_TxWait( void );
+static void enc28j60_TxStart( uint16_t start, uint16_t len );
+
+#ifdef ENC28J60_STATS
+static struct enc28j60_stats Enc28j60Stats;
+
+#define STAT_ADD(field, n)	Enc28j60Stats.field += (n)
+#define STAT_WAIT_BEGIN		uint16_t waitstart = micros()
+#define STAT_WAIT_END			Enc28j60Stats.dmawait += (uint16_t)micros() - waitstart
+#else
+#define STAT_ADD(field, n)
+#define STAT_WAIT_BEGIN
+#define STAT_WAIT_END
+#endif
+
 /*
 #define ENC28J60_CONTROL_CS     10
 #define SPI_MOSI				11
@@ -28,6 +62,7 @@ static uint16_t NextPacketPtr;
 #define SPI_SCK					13
 */
 
+#ifndef ENC28J60_EMU
 // set CS to 0 = active
 //#define CSACTIVE digitalWrite(ENC28J60_CONTROL_CS, LOW)
 #define CSACTIVE spiSelectDev(SPI_DEV_ETH)
@@ -36,9 +71,22 @@ static uint16_t NextPacketPtr;
 #define CSPASSIVE spiSelectDev(SPI_DEV_NONE)
 
 #define waitspi() while(!(SPSR&(1<<SPIF)))
+#else
+// host build, every SPI byte is exchanged with the register-level model
+#include "enc28j60emu.h"
+
+#define CSACTIVE enc28j60emu_Select(1)
+#define CSPASSIVE enc28j60emu_Select(0)
+
+#undef SPDR
+#define SPDR enc28j60emu_SPDR
+#define waitspi() enc28j60emu_Transfer()
+#endif
 
 uint8_t enc28j60ReadOp(uint8_t op, uint8_t address)
 {
+        STAT_ADD(regops, 1);
+        STAT_ADD(spibytes, (address & 0x80) ? 3 : 2);
         CSACTIVE;
         // issue read command
         SPDR = op | (address & ADDR_MASK);
@@ -59,6 +107,8 @@ uint8_t enc28j60ReadOp(uint8_t op, uint8_t address)
 
 void enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data)
 {
+        STAT_ADD(regops, 1);
+        STAT_ADD(spibytes, 2);
         CSACTIVE;
         // issue write command
         SPDR = op | (address & ADDR_MASK);
@@ -69,56 +119,84 @@ void enc28j60WriteOp(uint8_t op, uint8_t address, uint8_t data)
         CSPASSIVE;
 }
 
-void enc28j60ReadBuffer(uint16_t len, uint8_t* data)
+// Buffer transfers are pipelined: the next byte is fetched or stored while the
+// current one is still shifting, so at Fosc/2 the bus is almost never idle.
+// Reads exactly len bytes, the buffer functions of this driver use it.
+static void enc28j60_ReadBuf(uint16_t len, uint8_t* data)
 {
+        STAT_ADD(rdbytes, len);
+        STAT_ADD(spibytes, len+1);
         CSACTIVE;
         // issue read command
         SPDR = ENC28J60_READ_BUF_MEM;
         waitspi();
-        while(len)
+        if(len)
         {
-                len--;
-                // read data
                 SPDR = 0x00;
+                while(--len)
+                {
+                        // grab the byte and start the next transfer before storing it
+                        waitspi();
+                        uint8_t b = SPDR;
+                        SPDR = 0x00;
+                        *data++ = b;
+                }
                 waitspi();
-                *data = SPDR;
-                data++;
+                *data++ = SPDR;
         }
-        *data='\0';
         CSPASSIVE;
 }
 
+// the packet is zero terminated, data must have room for len+1 bytes
+void enc28j60ReadBuffer(uint16_t len, uint8_t* data)
+{
+        enc28j60_ReadBuf(len, data);
+        data[len]='\0';
+}
+
 void enc28j60WriteBuffer(uint16_t len, uint8_t* data)
 {
+        STAT_ADD(wrbytes, len);
+        STAT_ADD(spibytes, len+1);
         CSACTIVE;
         // issue write command
         SPDR = ENC28J60_WRITE_BUF_MEM;
-        waitspi();
         while(len)
         {
                 len--;
-                // write data
-                SPDR = *data;
-                data++;
+                // load next byte while the previous one is shifting
+                uint8_t b = *data++;
                 waitspi();
+                SPDR = b;
         }
+        waitspi();
         CSPASSIVE;
 }
 
+// stream bytes out of flash with post-incremented Z pointer
+#if defined(__AVR__) && !defined(ENC28J60_EMU)
+#define pgm_read_byte_inc(p) \
+        ({ uint8_t __b; __asm__ __volatile__ ("lpm %0, Z+" : "=r" (__b), "+z" (p)); __b; })
+#else
+#define pgm_read_byte_inc(p) pgm_read_byte((p)++)
+#endif
+
 void enc28j60WritePGMBuffer(uint16_t len, uint8_t* data)
 {
+        STAT_ADD(wrbytes, len);
+        STAT_ADD(spibytes, len+1);
         CSACTIVE;
         // issue write command
         SPDR = ENC28J60_WRITE_BUF_MEM;
-        waitspi();
         while(len)
         {
                 len--;
-                // write data
-                SPDR = pgm_read_byte(data);
-                data++;
+                // load next byte while the previous one is shifting
+                uint8_t b = pgm_read_byte_inc(data);
                 waitspi();
+                SPDR = b;
         }
+        waitspi();
         CSPASSIVE;
 }
 
@@ -127,6 +205,7 @@ void enc28j60SetBank(uint8_t address)
         // set the bank (if needed)
         if((address & BANK_MASK) != Enc28j60Bank)
         {
+                STAT_ADD(bankswitch, 1);
                 // set the bank
                 enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, (ECON1_BSEL1|ECON1_BSEL0));
                 enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, (address & BANK_MASK)>>5);
@@ -169,6 +248,18 @@ void enc28j60clkout(uint8_t clk)
 	enc28j60Write(ECOCON, clk & 0x7);
 }
 
+uint8_t enc28j60_Layout( const struct enc28j60_layout *layout ) {
+
+	if ( layout->txslots < 1 || layout->txslots > ENC28J60_MAXTXSLOTS ) return 0;
+	// an even staging area keeps ERXND odd, the ring ends on a word boundary
+	if ( layout->rxstage & 1 || layout->rxstage < ENC28J60_MINSTAGE ) return 0;
+	if ( layout->rxstage > 0x2000 - layout->txslots*TXSLOTSIZE - TXCTRLSIZE - ENC28J60_MINRXRING ) return 0;
+
+	Enc28j60Layout = *layout;
+
+return 1;
+}
+
 void enc28j60Init(uint8_t* macaddr)
 {
 /*
@@ -198,7 +289,7 @@ void enc28j60Init(uint8_t* macaddr)
 	// initialize SPI interface
 	// master mode and Fosc/2 clock:
  //       SPCR = (1<<SPE)|(1<<MSTR);
-//        SPSR |= (1<<SPI2X);
+        SPSR |= (1<<SPI2X);
 	// perform system reset
 	enc28j60WriteOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
 	delay(50);
@@ -208,6 +299,9 @@ void enc28j60Init(uint8_t* macaddr)
 	// do bank 0 stuff
 	// initialize receive buffer
 	// 16-bit transfers, must write low byte first
+	// the memory split every address below derives from
+	Enc28j60RxStage = Enc28j60Layout.rxstage;
+	Enc28j60TxSlots = Enc28j60Layout.txslots;
 	// set receive buffer start address
 	NextPacketPtr = RXSTART_INIT;
         // Rx start
@@ -222,6 +316,9 @@ void enc28j60Init(uint8_t* macaddr)
 	// TX start
 	enc28j60Write(ETXSTL, TXSTART_INIT&0xFF);
 	enc28j60Write(ETXSTH, TXSTART_INIT>>8);
+	Enc28j60TxStartAddr = TXSTART_INIT;
+	Enc28j60TxPending = 0;
+	enc28j60_TxSlot( 0 );
 	// TX end
 	enc28j60Write(ETXNDL, TXSTOP_INIT&0xFF);
 	enc28j60Write(ETXNDH, TXSTOP_INIT>>8);
@@ -271,6 +368,12 @@ void enc28j60Init(uint8_t* macaddr)
 	enc28j60PhyWrite(PHCON2, PHCON2_HDLDIS);
 	// switch to bank 0
 	enc28j60SetBank(ECON1);
+	// per-packet control bytes (0x00 means use macon3 settings) never change,
+	// they are written once for the control frame area and every TX slot
+	uint8_t ctrl = 0x00;
+	enc28j60_WriteMem( TXCTRL_INIT, &ctrl, 1 );
+	for ( uint8_t slot = 0 ; slot < TXSLOTS ; slot++ )
+		enc28j60_WriteMem( TXSTART_INIT + slot*TXSLOTSIZE, &ctrl, 1 );
 	// enable interrutps
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE|EIE_PKTIE);
 	// enable packet reception
@@ -285,22 +388,16 @@ uint8_t enc28j60getrev(void)
 
 void enc28j60PacketSend(uint16_t len, uint8_t* packet)
 {
-	// Set the write pointer to start of transmit buffer area
-	enc28j60Write(EWRPTL, TXSTART_INIT&0xFF);
-	enc28j60Write(EWRPTH, TXSTART_INIT>>8);
-	// Set the TXND pointer to correspond to the packet size given
-	enc28j60Write(ETXNDL, (TXSTART_INIT+len)&0xFF);
-	enc28j60Write(ETXNDH, (TXSTART_INIT+len)>>8);
-	// write per-packet control byte (0x00 means use macon3 settings)
-	enc28j60WriteOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+	uint16_t start = TXSTART_INIT;
+
+	enc28j60_TxWait();
+	// Set the write pointer to start of transmit buffer area, after the control byte
+	enc28j60Write(EWRPTL, (start+1)&0xFF);
+	enc28j60Write(EWRPTH, (start+1)>>8);
 	// copy the packet into the transmit buffer
 	enc28j60WriteBuffer(len, packet);
 	// send the contents of the transmit buffer onto the network
-	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-        // Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
-	if( (enc28j60Read(EIR) & EIR_TXERIF) ){
-                enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
-        }
+	enc28j60_TxStart( start, len );
 }
 
 // Gets a packet from the network receive buffer, if one is available.
@@ -352,6 +449,7 @@ uint16_t enc28j60PacketReceive(uint16_t maxlen, uint8_t* packet)
 	enc28j60Write(ERXRDPTH, (NextPacketPtr)>>8);
 	// decrement the packet counter indicate we are done with this packet
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+	if ( Enc28j60RxBatch ) Enc28j60RxBatch--;
 	return(len);
 }
 
@@ -371,7 +469,7 @@ void enc28j60_ReadMem( uint16_t addr, uint8_t *data, uint16_t dlen ) {
 	enc28j60Write(ERDPTL, addr&0xff);
 	enc28j60Write(ERDPTH, addr>>8);
 
-	enc28j60ReadBuffer(dlen, data);
+	enc28j60_ReadBuf(dlen, data);
 }
 
 void enc28j60_CopyMem( uint16_t saddr, uint16_t daddr, uint16_t len ) {
@@ -380,6 +478,7 @@ void enc28j60_CopyMem( uint16_t saddr, uint16_t daddr, uint16_t len ) {
 	enc28j60Write(EDMASTH, saddr>>8);
 
 	saddr += (len-1);		// the EDMAND registers should point to the last byte
+	if ( saddr-(len-1) <= RXSTOP_INIT ) saddr = enc28j60_RxAddr(saddr);	// DMA wraps in the RX ring
 	enc28j60Write(EDMANDL, saddr&0xff);
 	enc28j60Write(EDMANDH, saddr>>8);
 
@@ -402,7 +501,9 @@ void enc28j60_CopyMem( uint16_t saddr, uint16_t daddr, uint16_t len ) {
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
 
 	// wait until done
+	STAT_WAIT_BEGIN;
 	while ( enc28j60Read(ECON1) & ECON1_DMAST ) ;
+	STAT_WAIT_END;
 
 }
 
@@ -412,9 +513,12 @@ uint16_t enc28j60_checksum( uint16_t addr, uint16_t len ) {
 	enc28j60Write(EDMASTH, addr>>8);
 
 	addr += (len-1);		// the EDMAND registers should point to the last byte
+	if ( addr-(len-1) <= RXSTOP_INIT ) addr = enc28j60_RxAddr(addr);	// DMA wraps in the RX ring
 	enc28j60Write(EDMANDL, addr&0xFF);
 	enc28j60Write(EDMANDH, addr>>8);
 
+	STAT_WAIT_BEGIN;
+
 	// Wait while a packet is currently being received. See Silicon Errata point 17.
 	// (this will minimalize risk)
 	while ( enc28j60Read(ESTAT) & ESTAT_RXBUSY ) ;
@@ -427,20 +531,94 @@ uint16_t enc28j60_checksum( uint16_t addr, uint16_t len ) {
 	// wait until done
 	while ( enc28j60Read(ECON1) & ECON1_DMAST ) ;
 
+	STAT_WAIT_END;
+
 return (enc28j60Read(EDMACSL) | (enc28j60Read(EDMACSH)<<8));
 }
 
 // ---------------------------------
 
+static uint8_t Enc28j60RxFilter = ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_PMEN;		// as set by enc28j60Init()
+
+void enc28j60_SetRxFilter( uint8_t flags ) {
+
+	if ( flags == Enc28j60RxFilter ) return;
+
+	enc28j60Write(ERXFCON, flags);
+	Enc28j60RxFilter = flags;
+}
+
+void enc28j60_SetPattern( uint16_t offset, const uint8_t *mask, const uint8_t *pattern ) {
+
+	uint32_t sum = 0;
+	uint8_t n = 0;
+
+	for ( uint8_t i = 0 ; i < 8 ; i++ ) {
+
+		enc28j60Write(EPMM0+i, mask[i]);
+		for ( uint8_t m = mask[i] ; m ; m &= m-1 ) n++;
+	}
+
+	// the chip sums the selected bytes as if they were contiguous
+	for ( uint8_t i = 0 ; i < n ; i++ ) sum += (i & 1) ? pattern[i] : (uint16_t)pattern[i] << 8;
+	while ( sum >> 16 ) sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum;
+
+	enc28j60Write(EPMCSL, sum&0xff);
+	enc28j60Write(EPMCSH, (sum>>8)&0xff);
+
+	// writing EPMOH arms the new pattern
+	enc28j60Write(EPMOL, offset&0xff);
+	enc28j60Write(EPMOH, offset>>8);
+}
+
+// ---------------------------------
+
+static void enc28j60_isr( void ) {
+	Enc28j60RxPending = 1;
+}
+
+void enc28j60_AttachIRQ( uint8_t irq ) {
+
+	Enc28j60Irq = irq;
+
+	// drain whatever came in before
+	Enc28j60RxPending = 1;
+
+	// INT pin stays low while EPKTCNT is not zero, next edge comes after the ring was drained
+	attachInterrupt( irq, enc28j60_isr, FALLING );
+}
+
+uint8_t enc28j60_RxPending( void ) {
+	return Enc28j60RxBatch || Enc28j60Irq == ENC28J60_NOIRQ || Enc28j60RxPending;
+}
+
 uint16_t enc28j60_ReceivePkt( void ) {
 
 	uint16_t rxstat;
 	uint16_t pktlen;
 
-	// check if a packet has been received and buffered
-	//if( !(enc28j60Read(EIR) & EIR_PKTIF) ){
-	// The above does not work. See Rev. B4 Silicon Errata point 6.
-	if( enc28j60Read(EPKTCNT) == 0 ) return 0;
+	if ( !Enc28j60RxBatch ) {
+
+		if ( Enc28j60Irq != ENC28J60_NOIRQ ) {
+
+			// Stay off the bus until the INT pin fires. PKTIF is not fully reliable
+			// (Rev. B4 Silicon Errata point 6), so look at EPKTCNT now and then anyway.
+			if ( !Enc28j60RxPending && (uint16_t)millis() - Enc28j60PollTime < ENC28J60_IRQPOLL ) return 0;
+
+			// clear before reading EPKTCNT, so an edge in between is not lost
+			Enc28j60RxPending = 0;
+			Enc28j60PollTime = millis();
+		}
+
+		// check if a packet has been received and buffered
+		//if( !(enc28j60Read(EIR) & EIR_PKTIF) ){
+		// The above does not work. See Rev. B4 Silicon Errata point 6.
+		if ( !(Enc28j60RxBatch = enc28j60Read(EPKTCNT)) ) return 0;
+
+		// frames may arrive while this batch is handled, look again after it
+		Enc28j60RxPending = 1;
+	}
 
 	enc28j60Write(ERDPTL, (NextPacketPtr+2)&0xff);
 	enc28j60Write(ERDPTH, (NextPacketPtr+2)>>8);
@@ -465,8 +643,20 @@ uint16_t enc28j60_ReceivePkt( void ) {
 return pktlen;
 }
 
+// Wrap an address computed from a packet in the RX ring which ran
+// past either end of the ring. Must not be used on other addresses.
+uint16_t enc28j60_RxAddr( uint16_t addr ) {
+
+	if ( (int16_t)(addr - RXSTART_INIT) < 0 )
+		addr += RXSTOP_INIT - RXSTART_INIT + 1;
+	else if ( addr > RXSTOP_INIT && addr - RXSTOP_INIT <= RXSTOP_INIT - RXSTART_INIT + 1 )
+		addr -= RXSTOP_INIT - RXSTART_INIT + 1;
+
+return addr;
+}
+
 uint16_t enc28j60_ReceivedPktAddr() {
-	return (NextPacketPtr+6);
+	return enc28j60_RxAddr(NextPacketPtr+6);
 }
 
 uint16_t enc28j60_ReceivedPktLen() {
@@ -486,13 +676,13 @@ return pktlen;
 void enc28j60_ReadPacketData( uint16_t offset, uint8_t* data, uint16_t dlen ) {
 
 	if ( offset < MAX_FRAMELEN ) {
-		offset += (NextPacketPtr + 6);
+		offset = enc28j60_RxAddr(NextPacketPtr + 6 + offset);
 
 		enc28j60Write(ERDPTL, offset&0xFF);
 		enc28j60Write(ERDPTH, offset>>8);
 	}
 
-	enc28j60ReadBuffer(dlen, data);
+	enc28j60_ReadBuf(dlen, data);
 }
 
 void enc28j60_FreeReceivedPkt( void ) {
@@ -512,61 +702,254 @@ void enc28j60_FreeReceivedPkt( void ) {
 
 	// decrement the packet counter indicate we are done with this packet
 	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
+	if ( Enc28j60RxBatch ) Enc28j60RxBatch--;
 }
 
 // ---------------------------------
 
+// A frame may still be on the wire, its buffer and ETXST/ETXND must not change yet.
+// Waits until the last frame started is out. Completion is taken from EIR.TXIF,
+// or TXERIF when the transmission failed.
+static void enc28j60_TxWait( void ) {
+
+	uint8_t eir;
+
+	if ( !Enc28j60TxPending ) return;
+
+	STAT_WAIT_BEGIN;
+
+	while ( !((eir = enc28j60Read(EIR)) & (EIR_TXIF|EIR_TXERIF)) ) ;
+
+	// Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
+	// TXRTS may stay set after an error, the frame is lost either way.
+	if ( eir & EIR_TXERIF ) {
+		enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRST);
+		enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRST|ECON1_TXRTS);
+	}
+
+	Enc28j60TxPending = 0;
+
+	STAT_WAIT_END;
+}
+
+// the TX registers are shared with control frames, they are set when sending
+static void enc28j60_TxStart( uint16_t start, uint16_t len ) {
+
+	if ( start != Enc28j60TxStartAddr ) {
+		enc28j60Write(ETXSTL, start&0xFF);
+		enc28j60Write(ETXSTH, start>>8);
+		Enc28j60TxStartAddr = start;
+	}
+	enc28j60Write(ETXNDL, (start+len)&0xFF);
+	enc28j60Write(ETXNDH, (start+len)>>8);
+
+	// send the contents of the transmit buffer onto the network
+	enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXIF|EIR_TXERIF);
+	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+	Enc28j60TxPending = 1;
+}
+
+static uint8_t Enc28j60TxSlot;
+static uint16_t Enc28j60TxAddr;
+static uint16_t Enc28j60TxLen[ENC28J60_MAXTXSLOTS];
+#ifdef ENC28J60_SPISUM
+static uint32_t Enc28j60TxSums[ENC28J60_MAXTXSLOTS];
+static uint8_t Enc28j60TxOdd[ENC28J60_MAXTXSLOTS];		// next byte written is the high one of its word
+#endif
+
+void enc28j60_TxSlot( uint8_t slot ) {
+
+	Enc28j60TxSlot = slot;
+	Enc28j60TxAddr = TXSTART_INIT + slot*TXSLOTSIZE;
+}
+
 uint16_t enc28j60_NewPacket( uint16_t len ) {
 
-	// Set the write pointer to start of transmit buffer area
-	enc28j60Write(EWRPTL, TXSTART_INIT&0xFF);
-	enc28j60Write(EWRPTH, TXSTART_INIT>>8);
+	// only a slot still on the wire must not be written, the other one fills meanwhile
+	if ( Enc28j60TxAddr == Enc28j60TxStartAddr ) enc28j60_TxWait();
 
-	enc28j60Write(ETXNDL, (TXSTART_INIT+len)&0xFF);
-	enc28j60Write(ETXNDH, (TXSTART_INIT+len)>>8);
-	// write per-packet control byte (0x00 means use macon3 settings)
-	enc28j60WriteOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+	Enc28j60TxLen[Enc28j60TxSlot] = len;
+#ifdef ENC28J60_SPISUM
+	Enc28j60TxSums[Enc28j60TxSlot] = 0;
+#endif
 
-return TXSTART_INIT+1;
+return Enc28j60TxAddr+1;
 }
 
-void enc28j60_SetNewPacketLen( uint16_t pktlen ) {
+void enc28j60_CopyReceivedPkt( uint16_t len ) {
 
-	enc28j60Write(ETXNDL, (TXSTART_INIT+pktlen)&0xFF);
-	enc28j60Write(ETXNDH, (TXSTART_INIT+pktlen)>>8);
+	enc28j60_NewPacket( len );
+	enc28j60_CopyMem( enc28j60_RxAddr(NextPacketPtr + 6), Enc28j60TxAddr + 1, len );
+}
 
+void enc28j60_SetNewPacketLen( uint16_t pktlen ) {
+	Enc28j60TxLen[Enc28j60TxSlot] = pktlen;
 }
 
 uint16_t enc28j60_NewPktAddr() {
-	return TXSTART_INIT+1;
+	return Enc28j60TxAddr+1;
 }
 
 void enc28j60_WritePacketData( uint16_t offset, uint8_t* data, uint16_t dlen, uint8_t pgm ) {
 
+	enc28j60_StreamBegin( offset );
+	enc28j60_StreamData( data, dlen, pgm );
+	enc28j60_StreamEnd();
+}
+
+void enc28j60_StreamBegin( uint16_t offset ) {
+
 	if ( offset < MAX_FRAMELEN ) {
-		offset += (TXSTART_INIT + 1);
+#ifdef ENC28J60_SPISUM
+		Enc28j60TxOdd[Enc28j60TxSlot] = offset & 1;
+#endif
+		offset += (Enc28j60TxAddr + 1);
 		enc28j60Write(EWRPTL, offset&0xFF);
 		enc28j60Write(EWRPTH, offset>>8);
 	}
 
-	if ( pgm )
-		enc28j60WritePGMBuffer(dlen,data);
-	else
-		enc28j60WriteBuffer(dlen,data);
+	STAT_ADD(spibytes, 1);
+	CSACTIVE;
+	SPDR = ENC28J60_WRITE_BUF_MEM;
 }
 
-void enc28j60_SendNewPacket( void ) {
+void enc28j60_StreamData( uint8_t* data, uint16_t dlen, uint8_t pgm ) {
+
+	STAT_ADD(wrbytes, dlen);
+	STAT_ADD(spibytes, dlen);
+
+#ifdef ENC28J60_SPISUM
+	uint32_t sum = Enc28j60TxSums[Enc28j60TxSlot];
+	uint8_t odd = Enc28j60TxOdd[Enc28j60TxSlot];
+#endif
+
+	while ( dlen ) {
+		dlen--;
+		uint8_t b = pgm ? pgm_read_byte_inc(data) : *data++;
+		waitspi();
+		SPDR = b;
+#ifdef ENC28J60_SPISUM
+		// summed while it is shifting out
+		sum += odd ? (uint16_t)b<<8 : b;
+		odd ^= 1;
+#endif
+	}
 
-	// write per-packet control byte (0x00 means use macon3 settings)
-	enc28j60Write(EWRPTL, TXSTART_INIT&0xFF);
-	enc28j60Write(EWRPTH, TXSTART_INIT>>8);
-	enc28j60WriteOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
+#ifdef ENC28J60_SPISUM
+	Enc28j60TxSums[Enc28j60TxSlot] = sum;
+	Enc28j60TxOdd[Enc28j60TxSlot] = odd;
+#endif
+}
 
-	// send the contents of the transmit buffer onto the network
-	enc28j60WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
+void enc28j60_StreamEnd( void ) {
 
-	// Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
-	if ( (enc28j60Read(EIR) & EIR_TXERIF) ) {
-		enc28j60WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+	waitspi();
+	CSPASSIVE;
+}
+
+#ifdef ENC28J60_SPISUM
+void enc28j60_StreamSummed( uint8_t* data, uint16_t dlen, uint8_t pgm, uint16_t sum ) {
+
+	STAT_ADD(wrbytes, dlen);
+	STAT_ADD(spibytes, dlen);
+
+	// a sum of data starting on an odd byte is byte swapped (RFC 1071)
+	if ( Enc28j60TxOdd[Enc28j60TxSlot] ) sum = (sum<<8) | (sum>>8);
+
+	Enc28j60TxSums[Enc28j60TxSlot] += sum;
+	Enc28j60TxOdd[Enc28j60TxSlot] ^= dlen & 1;
+
+	while ( dlen ) {
+		dlen--;
+		uint8_t b = pgm ? pgm_read_byte_inc(data) : *data++;
+		waitspi();
+		SPDR = b;
+	}
+}
+
+uint16_t enc28j60_TxSum( void ) {
+
+	uint32_t sum = Enc28j60TxSums[Enc28j60TxSlot];
+
+	while ( sum>>16 )
+		sum = (sum & 0xffff) + (sum >> 16);
+
+return sum;
+}
+
+uint16_t enc28j60_SumPacketData( uint16_t offset, uint16_t dlen ) {
+
+	uint32_t sum = 0;
+	uint8_t odd = offset & 1;
+
+	offset = enc28j60_RxAddr(NextPacketPtr + 6 + offset);
+	enc28j60Write(ERDPTL, offset&0xFF);
+	enc28j60Write(ERDPTH, offset>>8);
+
+	STAT_ADD(rdbytes, dlen);
+	STAT_ADD(spibytes, dlen+1);
+	CSACTIVE;
+	SPDR = ENC28J60_READ_BUF_MEM;
+	waitspi();
+	if ( dlen ) {
+		SPDR = 0x00;
+		while ( --dlen ) {
+			// add the byte while the next one is shifting
+			waitspi();
+			uint8_t b = SPDR;
+			SPDR = 0x00;
+			sum += odd ? (uint16_t)b<<8 : b;
+			odd ^= 1;
+		}
+		waitspi();
+		sum += odd ? (uint16_t)SPDR<<8 : SPDR;
 	}
+	CSPASSIVE;
+
+	while ( sum>>16 )
+		sum = (sum & 0xffff) + (sum >> 16);
+
+return sum;
+}
+#endif
+
+void enc28j60_SendNewPacket( void ) {
+
+	enc28j60_TxWait();
+	enc28j60_TxStart( Enc28j60TxAddr, Enc28j60TxLen[Enc28j60TxSlot] );
+}
+
+// len must not exceed TXCTRLSIZE-8 (control byte and status vector)
+void enc28j60_SendCtrlPacket( uint16_t len, uint8_t* packet ) {
+
+	uint16_t start = TXCTRL_INIT;
+
+	if ( Enc28j60TxStartAddr == start ) enc28j60_TxWait();
+
+	// the control byte is in place since init
+	enc28j60Write(EWRPTL, (start+1)&0xFF);
+	enc28j60Write(EWRPTH, (start+1)>>8);
+	enc28j60WriteBuffer(len, packet);
+
+	enc28j60_TxWait();
+	enc28j60_TxStart( start, len );
+}
+
+// ---------------------------------
+
+#ifdef ENC28J60_STATS
+void enc28j60_GetStats( struct enc28j60_stats *st ) {
+	*st = Enc28j60Stats;
+}
+
+// turn a snapshot into counts accumulated since it was taken
+void enc28j60_StatsDelta( struct enc28j60_stats *st ) {
+
+	st->regops = Enc28j60Stats.regops - st->regops;
+	st->bankswitch = Enc28j60Stats.bankswitch - st->bankswitch;
+	st->rdbytes = Enc28j60Stats.rdbytes - st->rdbytes;
+	st->wrbytes = Enc28j60Stats.wrbytes - st->wrbytes;
+	st->spibytes = Enc28j60Stats.spibytes - st->spibytes;
+	st->dmawait = Enc28j60Stats.dmawait - st->dmawait;
 }
+#endif
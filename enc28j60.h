@@ -247,21 +247,34 @@
 // buffer boundaries applied to internal 8K ram
 // the entire available packet buffer space is allocated
 //
+// The split is set at run time by enc28j60_Layout(), from the top of memory down:
+// TX slots, control frame area, RX staging area for tcp/udp data, and the RX ring
+// gets what is left. Without the call ENC28J60_DEFSTAGE and ENC28J60_DEFTXSLOTS apply.
+//
 // start with recbuf at 0/
 #define RXSTART_INIT     0x0
 // receive buffer end
-#define RXSTOP_INIT      (0x1FFF-(0x0600<<1)-1)	// note: make also buffer for tcp/udp data
+#define RXSTOP_INIT      (TXSTART_INIT-TXCTRLSIZE-RXBUFSIZE-1)	// note: make also buffer for tcp/udp data
+
+#define RXBUFFER			(RXSTOP_INIT+1)
+#define RXBUFSIZE		Enc28j60RxStage
 
-#define RXBUFFER			RXSTOP_INIT+1
-#define RXBUFSIZE		0x0600
+// small frames (ARP, ICMP, TCP control) sent from RAM have their own TX area,
+// so they never clobber a data frame being built or kept in the TX buffer
+#define TXCTRL_INIT		(RXBUFFER+RXBUFSIZE)
+#define TXCTRLSIZE		0xC0
 
-// start TX buffer at 0x1FFF-0x0600, space for one full ethernet frame (~1500 bytes)
-#define TXSTART_INIT     (0x1FFF-0x0600)
+// TX buffer at the end of memory, split in slots for one full ethernet frame each
+// (control byte, frame and status vector). A frame kept in its slot can be sent again
+// without being rewritten, every slot taken costs RX ring space.
+#define TXSLOTS			Enc28j60TxSlots
+#define TXSLOTSIZE		0x0600
+#define TXSTART_INIT     (0x2000-TXSLOTS*TXSLOTSIZE)
 // stp TX buffer at end of mem
 #define TXSTOP_INIT      0x1FFF
 //
 // max frame length which the conroller will accept:
-#define        MAX_FRAMELEN        1500        // (note: maximum ethernet frame length would be 1518)
+#define        MAX_FRAMELEN        1518        // full ethernet frame, CRC included
 //#define MAX_FRAMELEN     600
 
 
@@ -284,22 +297,106 @@ extern uint8_t enc28j60getrev(void);
 // --------------------------------------------------------------------------------------------------------------------
 // Newly added functions (Adrian Brzezinski)
 
+// Buffer memory layout, a workload profile. enc28j60_Layout() keeps it for the next
+// enc28j60Init(), the layout in use and the chip do not change before. It returns 1,
+// or returns 0 and keeps the layout given before if this one does not fit: txslots must
+// be 1 to ENC28J60_MAXTXSLOTS, rxstage even and ENC28J60_MINSTAGE at least, and the RX
+// ring left over must hold ENC28J60_MINRXRING bytes at least.
+#define ENC28J60_DEFSTAGE	0x0600		// default layout
+#define ENC28J60_DEFTXSLOTS	2
+#define ENC28J60_MAXTXSLOTS	3
+#define ENC28J60_MINRXRING	0x0600		// one full frame and its receive status vector
+#define ENC28J60_MINSTAGE	0x0180		// smallest RX staging area
+
+struct enc28j60_layout {
+	uint16_t	rxstage;			// RX staging area for tcp/udp data, shared by the sockets
+	uint8_t	txslots;			// TX slots of TXSLOTSIZE, more of them keep more frames in flight
+};
+
+extern uint16_t Enc28j60RxStage;
+extern uint8_t Enc28j60TxSlots;
+
+uint8_t enc28j60_Layout( const struct enc28j60_layout *layout );
+
 void enc28j60_WriteMem( uint16_t addr, uint8_t *data, uint16_t dlen );
 void enc28j60_ReadMem( uint16_t addr, uint8_t *data, uint16_t dlen );
 void enc28j60_CopyMem( uint16_t saddr, uint16_t daddr, uint16_t len );
 uint16_t enc28j60_checksum( uint16_t addr, uint16_t len );
 
+// Receive filter, frames rejected here never enter the RX ring. The flags are ERXFCON
+// bits. A pattern is given as the bytes picked by mask (bit n of the mask selects byte n
+// of the 64 byte window at offset), its checksum is computed here.
+void enc28j60_SetRxFilter( uint8_t flags );
+void enc28j60_SetPattern( uint16_t offset, const uint8_t *mask, const uint8_t *pattern );
+
+// Interrupt driven reception. With the INT pin attached to an external interrupt
+// enc28j60_ReceivePkt() does not touch the bus until the chip signals a frame,
+// then drains the RX ring in one batch.
+#define ENC28J60_NOIRQ		0xff
+#define ENC28J60_IRQPOLL	250		// ms, fallback EPKTCNT poll while no interrupt comes
+
+void enc28j60_AttachIRQ( uint8_t irq );
+uint8_t enc28j60_RxPending( void );
+
 uint16_t enc28j60_ReceivePkt( void );
 uint16_t enc28j60_ReceivedPktAddr();
 uint16_t enc28j60_ReceivedPktLen();
+uint16_t enc28j60_RxAddr( uint16_t addr );
+
+// pass as offset to read or write on from the current buffer pointer
+#define ENC28J60_NEXT	0xffff
+
 void enc28j60_ReadPacketData( uint16_t offset, uint8_t* data, uint16_t dlen );
 void enc28j60_FreeReceivedPkt( void );
 
+// the NewPacket functions below work on the selected TX slot
+void enc28j60_TxSlot( uint8_t slot );
+
 uint16_t enc28j60_NewPacket( uint16_t len );
+// new packet made of the received one by the DMA engine, changes are written over it
+void enc28j60_CopyReceivedPkt( uint16_t len );
 void enc28j60_SetNewPacketLen( uint16_t pktlen );
 uint16_t enc28j60_NewPktAddr();
 void enc28j60_WritePacketData( uint16_t offset, uint8_t* data, uint16_t dlen, uint8_t pgm );
+// one write command for several pieces, nothing else may use the SPI bus in between
+void enc28j60_StreamBegin( uint16_t offset );
+void enc28j60_StreamData( uint8_t* data, uint16_t dlen, uint8_t pgm );
+void enc28j60_StreamEnd( void );
 void enc28j60_SendNewPacket( void );
+void enc28j60_SendCtrlPacket( uint16_t len, uint8_t* packet );
+
+// Checksums summed inside the SPI transfer loops, with no DMA pass and no wait for
+// a frame being received (errata 17). Sums are folded but not complemented, in memory
+// byte order like the software checksum. Everything written to a TX slot since its
+// NewPacket is summed, received data is summed as it is read out.
+#define ENC28J60_SPISUM
+
+#ifdef ENC28J60_SPISUM
+uint16_t enc28j60_TxSum( void );
+// writes data whose sum is known already, without summing it again
+void enc28j60_StreamSummed( uint8_t* data, uint16_t dlen, uint8_t pgm, uint16_t sum );
+uint16_t enc28j60_SumPacketData( uint16_t offset, uint16_t dlen );
+#endif
+
+// --------------------------------------------------------------------------------------------------------------------
+// SPI accounting, counters are compiled in only when ENC28J60_STATS is defined.
+// Counters wrap around, take a snapshot before and a delta after the operation to be measured.
+
+//#define ENC28J60_STATS
+
+#ifdef ENC28J60_STATS
+struct enc28j60_stats {
+	uint16_t	regops;			// single byte operations (ReadOp/WriteOp)
+	uint16_t	bankswitch;		// bank changes done by enc28j60SetBank
+	uint16_t	rdbytes;			// buffer memory bytes read
+	uint16_t	wrbytes;			// buffer memory bytes written
+	uint16_t	spibytes;			// all bytes clocked over SPI, opcodes included
+	uint16_t	dmawait;			// microseconds spent waiting for the DMA and checksum engine
+};
+
+void enc28j60_GetStats( struct enc28j60_stats *st );
+void enc28j60_StatsDelta( struct enc28j60_stats *st );
+#endif
 
 #endif
 //@}
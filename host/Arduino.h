@@ -0,0 +1,95 @@
+/*
+
+  -------------------------------------------------------------------
+      Arduino.h, minimal Arduino core replacement for host builds
+  -------------------------------------------------------------------
+
+	Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+
+	Only what the stack and the sketches use is provided here.
+	Time, interrupts and I/O are implemented in hostmain.cpp.
+*/
+
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#define HIGH		0x1
+#define LOW		0x0
+
+#define INPUT		0x0
+#define OUTPUT	0x1
+
+#define CHANGE	1
+#define FALLING	2
+#define RISING		3
+
+#define DEC		10
+#define HEX		16
+
+// AVR SPI and stack registers, written by sketches but never read back
+#define SPE		6
+#define MSTR		4
+#define SPIF		7
+#define SPI2X	0
+#define RAMEND	0x8FF
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern volatile uint8_t SPCR;
+extern volatile uint8_t SPSR;
+extern volatile uint8_t SPDR;
+extern volatile uint8_t PORTB;
+extern volatile uint8_t SPH;
+extern volatile uint8_t SPL;
+
+// millis() and micros() are 32 bit wide, as on AVR
+uint32_t millis( void );
+uint32_t micros( void );
+void delay( uint32_t ms );
+void delayMicroseconds( uint16_t us );
+
+void pinMode( uint8_t pin, uint8_t mode );
+void digitalWrite( uint8_t pin, uint8_t val );
+int digitalRead( uint8_t pin );
+
+void attachInterrupt( uint8_t irq, void (*isr)(void), int mode );
+void detachInterrupt( uint8_t irq );
+void interrupts( void );
+void noInterrupts( void );
+
+char *utoa( unsigned int val, char *buf, int radix );
+
+#ifdef __cplusplus
+}
+
+class HardwareSerial {
+
+public:
+	void begin( unsigned long ) { }
+
+	void print( const char *s ) { fputs(s, stderr); }
+	void print( char c ) { fputc(c, stderr); }
+	void print( unsigned long n, int base = DEC ) { fprintf(stderr, (base == HEX) ? "%lX" : "%lu", n); }
+	void print( long n, int base = DEC ) { if ( base == HEX ) print((unsigned long)n, base); else fprintf(stderr, "%ld", n); }
+	void print( unsigned int n, int base = DEC ) { print((unsigned long)n, base); }
+	void print( int n, int base = DEC ) { print((long)n, base); }
+	void print( unsigned char n, int base = DEC ) { print((unsigned long)n, base); }
+
+	void println( void ) { fputc('\n', stderr); }
+	template<class T> void println( T v ) { print(v); println(); }
+	template<class T> void println( T v, int base ) { print(v, base); println(); }
+};
+
+extern HardwareSerial Serial;
+
+#endif
+
+#endif /* __HOST_ARDUINO_H__ */
@@ -0,0 +1,32 @@
+/*
+
+  -------------------------------------------------------------------
+      avr/pgmspace.h, program memory stubs for host builds
+  -------------------------------------------------------------------
+
+	Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+
+	On the host there is only one address space, so flash helpers
+	collapse to plain memory accesses.
+*/
+
+#ifndef __HOST_PGMSPACE_H__
+#define __HOST_PGMSPACE_H__
+
+#include <inttypes.h>
+#include <string.h>
+
+#define PROGMEM
+#define PGM_P				const char *
+#define PSTR(s)			((const char *)(s))
+
+#define pgm_read_byte(addr)		(*(const uint8_t *)(addr))
+#define pgm_read_word(addr)		(*(const uint16_t *)(addr))
+#define pgm_read_dword(addr)	(*(const uint32_t *)(addr))
+
+#define strncmp_P(s1, s2, n)	strncmp((s1), (s2), (n))
+#define strcmp_P(s1, s2)			strcmp((s1), (s2))
+#define strlen_P(s)					strlen((s))
+#define memcpy_P(d, s, n)		memcpy((d), (s), (n))
+
+#endif /* __HOST_PGMSPACE_H__ */
@@ -0,0 +1,120 @@
+/*
+
+  -------------------------------------------------------------------
+      cksumtest.cpp, checks the checksum kernel against a reference
+  -------------------------------------------------------------------
+
+	Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+
+	Build and run (from the sketch directory):
+
+	  g++ -O2 -DENC28J60_EMU -Ihost -I. -x c++ host/cksumtest.cpp aSocket.cpp \
+	      host/hostmain.cpp -x c enc28j60.c host/enc28j60emu.c -x none -o cksumtest
+	  ./cksumtest -n
+
+	Every length up to a full frame is summed, odd ones and those past the
+	255-pass blocks of the AVR kernel included, over random data and over
+	0xff bytes that carry on every add. csum_replace() is checked against
+	summing the changed header again. Exits with 1 on any mismatch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Arduino.h"
+#include "aInet.h"
+
+uint16_t checksum(uint16_t* addr, uint16_t len, uint16_t sum);
+uint16_t csum_replace( uint16_t check, uint16_t m, uint16_t m1 );
+
+#define MAXLEN		1600
+#define ROUNDS		8
+
+// byte at a time, words in memory byte order
+static uint16_t RefSum( const uint8_t *data, uint16_t len, uint16_t sum ) {
+
+	uint32_t acc = sum;
+
+	for ( uint16_t i = 0 ; i < len ; i++ )
+		acc += ( i & 1 ) ? (uint16_t)data[i] << 8 : data[i];
+
+	while ( acc>>16 )
+		acc = (acc & 0xffff) + (acc >> 16);
+
+return ~acc;
+}
+
+// 0x0000 and 0xffff are both zero in ones complement
+static uint8_t SameSum( uint16_t a, uint16_t b ) {
+
+return a == b || ( (a == 0 || a == 0xffff) && (b == 0 || b == 0xffff) );
+}
+
+static void Fill( uint8_t *data, uint16_t len, uint8_t round ) {
+
+	for ( uint16_t i = 0 ; i < len ; i++ )
+		data[i] = ( round & 1 ) ? 0xff : rand();
+}
+
+void setup() {
+
+	static uint16_t buf[MAXLEN/2+1];
+	uint8_t *data = (uint8_t*)buf;
+	uint32_t fails = 0;
+
+	srand(1);
+
+	for ( uint8_t round = 0 ; round < ROUNDS ; round++ ) {
+
+		for ( uint16_t len = 0 ; len <= MAXLEN ; len++ ) {
+
+			uint16_t sum = ( round & 2 ) ? 0xffff : rand();
+
+			Fill( data, len, round );
+
+			if ( checksum(buf, len, 0) != RefSum(data, len, 0) ) {
+				fprintf(stderr, "checksum len %u round %u\n", len, round);
+				fails++;
+			}
+
+			if ( checksum(buf, len, sum) != RefSum(data, len, sum) ) {
+				fprintf(stderr, "checksum len %u round %u sum %04x\n", len, round, sum);
+				fails++;
+			}
+		}
+	}
+
+	// a header field changes from m to m1, the patched sum must match a new one
+	for ( uint32_t i = 0 ; i < 100000 ; i++ ) {
+
+		uint16_t len = 2 + 2*(rand() % 30);
+		uint16_t w = rand() % (len/2);
+		uint16_t check, m, m1;
+
+		Fill( data, len, i );
+		check = checksum(buf, len, 0);
+
+		m = buf[w];
+		m1 = buf[w] = ( i & 2 ) ? rand() : ( i & 4 ) ? 0xffff : 0;
+
+		if ( !SameSum( csum_replace(check, m, m1), checksum(buf, len, 0) ) ) {
+			fprintf(stderr, "csum_replace %04x %04x>%04x\n", check, m, m1);
+			fails++;
+		}
+	}
+
+	// host speed only, the AVR kernel is timed on the board
+	uint32_t t = micros();
+	uint16_t acc = 0;
+
+	Fill( data, ETH_FRAME_LEN, 0 );
+	for ( uint16_t i = 0 ; i < 10000 ; i++ ) acc += checksum(buf, ETH_FRAME_LEN, acc);
+	t = micros() - t;
+
+	printf("cksumtest: %lu failures, %u byte frames at %lu ns\n", (unsigned long)fails, ETH_FRAME_LEN, (unsigned long)t/10);
+
+	exit( fails ? 1 : 0 );
+}
+
+void loop() {
+}
@@ -0,0 +1,536 @@
+/*
+
+  -------------------------------------------------------------------
+      enc28j60emu.c, ENC28J60 register-level model for host builds
+  -------------------------------------------------------------------
+
+	Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+
+	Timing is not modelled, DMA and transmission complete at once.
+	Register and buffer behaviour follows the DS39662 datasheet.
+*/
+
+#include <string.h>
+#include "enc28j60.h"
+#include "enc28j60emu.h"
+
+#define EMU_MEMSIZE	0x2000
+#define EMU_MEMMASK	0x1FFF
+
+#define EMU_ALEN		6
+#define EMU_ZLEN		60
+#define EMU_FRAMELEN	1514
+
+uint8_t enc28j60emu_SPDR;
+struct enc28j60emu_stats enc28j60emu_Stats;
+
+static struct {
+	uint8_t		regs[4][32];		// all-bank registers (0x1B-0x1F) live in bank 0
+	uint16_t	phy[32];
+	uint8_t		mem[EMU_MEMSIZE];
+
+	uint8_t		cs;
+	uint8_t		cmd;
+	uint16_t	nbyte;				// byte index within current transaction
+	uint8_t		intpin;
+} chip;
+
+static void (*TxHook)(const uint8_t *frame, uint16_t len);
+static void (*IntHook)(void);
+
+// ---------------------------------
+
+static uint8_t *reg( uint8_t address ) {
+
+	uint8_t a = address & ADDR_MASK;
+
+	if ( a >= EIE ) return &chip.regs[0][a];
+
+return &chip.regs[chip.regs[0][ECON1] & (ECON1_BSEL1|ECON1_BSEL0)][a];
+}
+
+static uint16_t reg16( uint8_t lo ) {
+	return chip.regs[0][lo] | (chip.regs[0][lo+1] << 8);
+}
+
+static void setreg16( uint8_t lo, uint16_t val ) {
+	chip.regs[0][lo] = val & 0xff;
+	chip.regs[0][lo+1] = (val >> 8) & 0x1f;
+}
+
+// MAC and MII registers shift out a dummy byte first
+static uint8_t IsMacMii( uint8_t address ) {
+
+	uint8_t bank = chip.regs[0][ECON1] & (ECON1_BSEL1|ECON1_BSEL0);
+	address &= ADDR_MASK;
+
+	if ( address >= EIE ) return 0;
+	if ( bank == 2 ) return address <= (MIRDH & ADDR_MASK);
+	if ( bank == 3 ) return address <= (MAADR4 & ADDR_MASK) || address == (MISTAT & ADDR_MASK);
+
+return 0;
+}
+
+static uint8_t InRxRing( uint16_t addr ) {
+	return addr >= reg16(ERXSTL) && addr <= reg16(ERXNDL);
+}
+
+// advance pointer, wrapping at the end of the receive buffer when inside of it
+static uint16_t RxNext( uint16_t addr ) {
+
+	if ( InRxRing(addr) && addr == reg16(ERXNDL) ) return reg16(ERXSTL);
+
+return (addr + 1) & EMU_MEMMASK;
+}
+
+static void UpdateInt( void ) {
+
+	uint8_t eie = chip.regs[0][EIE];
+	uint8_t eir = chip.regs[0][EIR];
+	uint8_t pin = !((eie & EIE_INTIE) && (eie & eir & 0x7f));
+
+	if ( pin ) chip.regs[0][ESTAT] &= ~ESTAT_INT;
+	else chip.regs[0][ESTAT] |= ESTAT_INT;
+
+	if ( chip.intpin && !pin && IntHook ) {
+		chip.intpin = pin;
+		IntHook();
+	}
+
+	chip.intpin = pin;
+}
+
+static void Reset( void ) {
+
+	memset(chip.regs, 0, sizeof(chip.regs));
+	memset(chip.phy, 0, sizeof(chip.phy));
+
+	chip.regs[0][ECON2] = ECON2_AUTOINC;
+	chip.regs[0][ESTAT] = ESTAT_CLKRDY;
+	setreg16(ERXNDL, 0x1FFF);
+	setreg16(ERXRDPTL, 0x0FFA);
+	setreg16(ETXNDL, 0);
+	chip.regs[1][ERXFCON & ADDR_MASK] = ERXFCON_UCEN|ERXFCON_CRCEN|ERXFCON_BCEN;
+	chip.regs[2][MAMXFLL & ADDR_MASK] = 0xEE;
+	chip.regs[2][MAMXFLH & ADDR_MASK] = 0x05;
+	chip.regs[3][EREVID & ADDR_MASK] = 0x06;
+
+	chip.phy[PHSTAT1] = PHSTAT1_LLSTAT;
+	chip.phy[PHSTAT2] = 0x0400;		// LSTAT
+	chip.phy[PHHID1] = 0x0083;
+	chip.phy[PHHID2] = 0x1400;
+
+	chip.intpin = 1;
+}
+
+// ---------------------------------
+
+static uint16_t Checksum( uint16_t addr, uint16_t end ) {
+
+	uint32_t sum = 0;
+	uint8_t odd = 0;
+
+	for ( ;; addr = RxNext(addr) ) {
+
+		sum += odd ? chip.mem[addr] : (chip.mem[addr] << 8);
+		odd ^= 1;
+		enc28j60emu_Stats.dma_bytes++;
+
+		if ( addr == end ) break;
+	}
+
+	while ( sum >> 16 ) sum = (sum & 0xffff) + (sum >> 16);
+
+return ~sum & 0xffff;
+}
+
+static void StartDMA( void ) {
+
+	uint16_t src = reg16(EDMASTL);
+	uint16_t end = reg16(EDMANDL);
+
+	if ( chip.regs[0][ECON1] & ECON1_CSUMEN ) {
+
+		uint16_t cs = Checksum(src, end);
+
+		chip.regs[0][EDMACSH] = cs >> 8;
+		chip.regs[0][EDMACSL] = cs & 0xff;
+		enc28j60emu_Stats.dma_checksums++;
+
+	} else {
+
+		uint16_t dst = reg16(EDMADSTL);
+
+		for ( ;; src = RxNext(src), dst = RxNext(dst) ) {
+
+			chip.mem[dst] = chip.mem[src];
+			enc28j60emu_Stats.dma_bytes++;
+
+			if ( src == end ) break;
+		}
+
+		enc28j60emu_Stats.dma_copies++;
+	}
+
+	chip.regs[0][ECON1] &= ~ECON1_DMAST;
+	chip.regs[0][EIR] |= EIR_DMAIF;
+}
+
+static void Transmit( void ) {
+
+	uint16_t start = reg16(ETXSTL);
+	uint16_t end = reg16(ETXNDL);
+	uint16_t len = (end - start) & EMU_MEMMASK;
+	uint8_t frame[EMU_MEMSIZE];
+
+	// first byte is the per-packet control byte
+	for ( uint16_t i = 0 ; i < len ; i++ )
+		frame[i] = chip.mem[(start + 1 + i) & EMU_MEMMASK];
+
+	// automatic padding, see MACON3.PADCFG
+	if ( (chip.regs[2][MACON3 & ADDR_MASK] & (MACON3_PADCFG0|MACON3_PADCFG1|MACON3_PADCFG2)) && len < EMU_ZLEN ) {
+		memset(frame + len, 0, EMU_ZLEN - len);
+		len = EMU_ZLEN;
+	}
+
+	if ( TxHook ) TxHook(frame, len);
+	enc28j60emu_Stats.tx_frames++;
+
+	// transmit status vector follows the frame
+	uint8_t tsv[7] = { (uint8_t)len, (uint8_t)(len >> 8), 0x80, 0, 0, 0, 0 };
+	for ( uint8_t i = 0 ; i < sizeof(tsv) ; i++ )
+		chip.mem[(end + 1 + i) & EMU_MEMMASK] = tsv[i];
+
+	chip.regs[0][ECON1] &= ~ECON1_TXRTS;
+	chip.regs[0][EIR] |= EIR_TXIF;
+}
+
+static void WriteReg( uint8_t address, uint8_t val ) {
+
+	uint8_t a = address & ADDR_MASK;
+	uint8_t *r = reg(address);
+	uint8_t old = *r;
+	uint8_t bank = (a >= EIE) ? 0 : (chip.regs[0][ECON1] & (ECON1_BSEL1|ECON1_BSEL0));
+
+	switch ( a ) {
+
+	case EIR:
+		// flags can only be cleared, PKTIF follows EPKTCNT
+		*r = (old & val & ~EIR_PKTIF) | (old & EIR_PKTIF);
+	break;
+
+	case ESTAT:
+		// status bits are read only
+	break;
+
+	case ECON2:
+		*r = val & ~ECON2_PKTDEC;
+		if ( (val & ECON2_PKTDEC) && chip.regs[1][EPKTCNT & ADDR_MASK] ) {
+			if ( !--chip.regs[1][EPKTCNT & ADDR_MASK] ) chip.regs[0][EIR] &= ~EIR_PKTIF;
+		}
+	break;
+
+	case ECON1:
+		*r = val;
+		if ( (val & ECON1_DMAST) && !(old & ECON1_DMAST) ) StartDMA();
+		if ( (val & ECON1_TXRTS) && !(old & ECON1_TXRTS) ) Transmit();
+	break;
+
+	default:
+		if ( bank == 1 && a == (EPKTCNT & ADDR_MASK) ) break;		// read only
+		if ( bank == 0 && (a == ERXWRPTL || a == ERXWRPTH) ) break;	// read only
+
+		*r = val;
+
+		// programming ERXST also moves the hardware write pointer
+		if ( bank == 0 && (a == ERXSTL || a == ERXSTH) ) setreg16(ERXWRPTL, reg16(ERXSTL));
+
+		if ( bank == 2 && a == (MICMD & ADDR_MASK) && (val & MICMD_MIIRD) ) {
+			uint16_t d = chip.phy[chip.regs[2][MIREGADR & ADDR_MASK] & 0x1f];
+			chip.regs[2][MIRDL & ADDR_MASK] = d & 0xff;
+			chip.regs[2][MIRDH & ADDR_MASK] = d >> 8;
+		}
+
+		// writing MIWRH starts the PHY write
+		if ( bank == 2 && a == (MIWRH & ADDR_MASK) )
+			chip.phy[chip.regs[2][MIREGADR & ADDR_MASK] & 0x1f] = chip.regs[2][MIWRL & ADDR_MASK] | (val << 8);
+	break;
+	}
+
+	UpdateInt();
+}
+
+static uint8_t ReadReg( uint8_t address ) {
+	return *reg(address);
+}
+
+// ---------------------------------
+
+void enc28j60emu_Select( uint8_t cs ) {
+
+	static uint8_t powered;
+
+	// power-on reset
+	if ( !powered ) {
+		Reset();
+		powered = 1;
+	}
+
+	if ( cs && !chip.cs ) {
+		chip.nbyte = 0;
+		enc28j60emu_Stats.spi_transactions++;
+	}
+
+	chip.cs = cs;
+}
+
+void enc28j60emu_Transfer( void ) {
+
+	uint8_t mosi = enc28j60emu_SPDR;
+	uint8_t miso = 0;
+	uint8_t a = chip.cmd & ADDR_MASK;
+
+	enc28j60emu_Stats.spi_bytes++;
+
+	if ( !chip.cs ) {
+		enc28j60emu_SPDR = 0xff;
+		return;
+	}
+
+	if ( chip.nbyte++ == 0 ) {
+
+		chip.cmd = mosi;
+
+		if ( mosi == ENC28J60_SOFT_RESET ) {
+			Reset();
+			memset(&chip.mem, 0, sizeof(chip.mem));
+		}
+
+		enc28j60emu_SPDR = 0;
+		return;
+	}
+
+	switch ( chip.cmd & 0xE0 ) {
+
+	case ENC28J60_READ_CTRL_REG:
+		miso = ReadReg(a);
+		if ( chip.nbyte == 2 && IsMacMii(a) ) miso = 0;		// dummy byte
+	break;
+
+	case ENC28J60_WRITE_CTRL_REG:
+		if ( chip.nbyte == 2 ) WriteReg(a, mosi);
+	break;
+
+	case ENC28J60_BIT_FIELD_SET:
+		if ( chip.nbyte == 2 ) WriteReg(a, ReadReg(a) | mosi);
+	break;
+
+	case ENC28J60_BIT_FIELD_CLR:
+		if ( chip.nbyte == 2 ) WriteReg(a, ReadReg(a) & ~mosi);
+	break;
+	}
+
+	// buffer memory access, pointers auto increment (ECON2.AUTOINC)
+	if ( chip.cmd == ENC28J60_READ_BUF_MEM ) {
+
+		uint16_t p = reg16(ERDPTL);
+
+		miso = chip.mem[p];
+		if ( chip.regs[0][ECON2] & ECON2_AUTOINC ) setreg16(ERDPTL, RxNext(p));
+
+	} else if ( chip.cmd == ENC28J60_WRITE_BUF_MEM ) {
+
+		uint16_t p = reg16(EWRPTL);
+
+		chip.mem[p] = mosi;
+		if ( chip.regs[0][ECON2] & ECON2_AUTOINC ) setreg16(EWRPTL, (p + 1) & EMU_MEMMASK);
+	}
+
+	enc28j60emu_SPDR = miso;
+}
+
+// ---------------------------------
+
+static uint32_t crc32( const uint8_t *data, uint16_t len ) {
+
+	uint32_t crc = 0xffffffff;
+
+	while ( len-- ) {
+		crc ^= *data++;
+		for ( uint8_t b = 0 ; b < 8 ; b++ )
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+return ~crc;
+}
+
+static uint8_t PatternMatch( const uint8_t *frame, uint16_t len ) {
+
+	uint16_t off = chip.regs[1][EPMOL & ADDR_MASK] | (chip.regs[1][EPMOH & ADDR_MASK] << 8);
+	uint16_t cs = chip.regs[1][EPMCSL & ADDR_MASK] | (chip.regs[1][EPMCSH & ADDR_MASK] << 8);
+	uint32_t sum = 0;
+	uint8_t odd = 0;
+
+	// the window may cover the CRC, but not run past it
+	if ( off + 64 > len + 4 ) return 0;
+
+	for ( uint8_t i = 0 ; i < 64 ; i++ ) {
+
+		if ( !(chip.regs[1][(EPMM0 & ADDR_MASK) + (i >> 3)] & (1 << (i & 7))) ) continue;
+
+		sum += odd ? frame[off+i] : (frame[off+i] << 8);
+		odd ^= 1;
+	}
+
+	while ( sum >> 16 ) sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+
+	// EPMCSH holds the first (high) byte of the checksum
+return sum == cs;
+}
+
+// The pointer is bits 28:23 of the CRC register after the destination address went
+// through, as in Microchip's reference code: MSB first, each byte fed LSB first, no
+// final inversion. That is not the reflected and inverted FCS of crc32() above.
+static uint8_t HashMatch( const uint8_t *frame ) {
+
+	uint32_t crc = 0xffffffff;
+
+	for ( uint8_t i = 0 ; i < EMU_ALEN ; i++ )
+		for ( uint8_t b = 0 ; b < 8 ; b++ )
+			crc = (crc << 1) ^ (0x04C11DB7 & -(((crc >> 31) ^ (frame[i] >> b)) & 1));
+
+	uint8_t ptr = (crc >> 23) & 0x3f;
+
+return chip.regs[1][(EHT0 & ADDR_MASK) + (ptr >> 3)] & (1 << (ptr & 7));
+}
+
+static uint8_t Filter( const uint8_t *frame, uint16_t len ) {
+
+	uint8_t fcon = chip.regs[1][ERXFCON & ADDR_MASK];
+	uint8_t andor = fcon & ERXFCON_ANDOR;
+	uint8_t bcast = 1, mcast, ucast = 1;
+	uint8_t any = 0, all = 1, m;
+
+	for ( uint8_t i = 0 ; i < EMU_ALEN ; i++ ) {
+		if ( frame[i] != 0xff ) bcast = 0;
+	}
+	mcast = (frame[0] & 1) && !bcast;
+
+	// MAADR registers are byte-backward
+	static const uint8_t maadr[EMU_ALEN] = { MAADR5, MAADR4, MAADR3, MAADR2, MAADR1, MAADR0 };
+	for ( uint8_t i = 0 ; i < EMU_ALEN ; i++ ) {
+		if ( frame[i] != chip.regs[3][maadr[i] & ADDR_MASK] ) ucast = 0;
+	}
+
+	#define FILTER(bit, cond)	if ( fcon & (bit) ) { m = (cond); any |= m; all &= m; }
+
+	FILTER( ERXFCON_UCEN, ucast );
+	FILTER( ERXFCON_BCEN, bcast );
+	FILTER( ERXFCON_MCEN, mcast );
+	FILTER( ERXFCON_HTEN, HashMatch(frame) );
+	FILTER( ERXFCON_PMEN, PatternMatch(frame, len) );
+
+	#undef FILTER
+
+	// promiscuous mode when all filters are disabled
+	if ( !(fcon & (ERXFCON_UCEN|ERXFCON_BCEN|ERXFCON_MCEN|ERXFCON_HTEN|ERXFCON_PMEN|ERXFCON_MPEN)) ) return 1;
+
+return andor ? all : any;
+}
+
+static void RxWrite( uint16_t *p, uint8_t val ) {
+
+	chip.mem[*p] = val;
+	*p = RxNext(*p);
+}
+
+uint8_t enc28j60emu_ReceiveFrame( const uint8_t *data, uint16_t len ) {
+
+	uint8_t frame[EMU_MEMSIZE];
+	uint16_t maxlen = chip.regs[2][MAMXFLL & ADDR_MASK] | (chip.regs[2][MAMXFLH & ADDR_MASK] << 8);
+
+	if ( !(chip.regs[0][ECON1] & ECON1_RXEN) ) return 0;
+
+	if ( len > EMU_FRAMELEN ) {
+		enc28j60emu_Stats.rx_dropped++;
+		return 0;
+	}
+
+	// frames shorter than 60 bytes are padded on the wire
+	memcpy(frame, data, len);
+	if ( len < EMU_ZLEN ) {
+		memset(frame + len, 0, EMU_ZLEN - len);
+		len = EMU_ZLEN;
+	}
+
+	if ( !Filter(frame, len) ) {
+		enc28j60emu_Stats.rx_filtered++;
+		return 0;
+	}
+
+	uint16_t rxst = reg16(ERXSTL);
+	uint16_t rxnd = reg16(ERXNDL);
+	uint16_t wrpt = reg16(ERXWRPTL);
+	uint16_t rdpt = reg16(ERXRDPTL);
+	uint16_t size = rxnd - rxst + 1;
+	uint16_t used = (wrpt >= rdpt) ? wrpt - rdpt : size - (rdpt - wrpt);
+	uint16_t count = len + 4;	// with CRC
+	uint16_t need = 6 + count + (count & 1);
+
+	// the write pointer may never catch up with ERXRDPT
+	if ( (count > maxlen && !(chip.regs[2][MACON3 & ADDR_MASK] & MACON3_HFRMLEN))
+			|| chip.regs[1][EPKTCNT & ADDR_MASK] == 0xff || need >= size - used ) {
+
+		chip.regs[0][EIR] |= EIR_RXERIF;
+		enc28j60emu_Stats.rx_dropped++;
+		UpdateInt();
+		return 0;
+	}
+
+	uint16_t next = wrpt;
+	for ( uint16_t i = 0 ; i < need ; i++ ) next = RxNext(next);
+
+	uint8_t bcast = (frame[0] & frame[1] & frame[2] & frame[3] & frame[4] & frame[5]) == 0xff;
+	uint32_t crc = crc32(frame, len);
+
+	uint16_t p = wrpt;
+	RxWrite(&p, next & 0xff);
+	RxWrite(&p, next >> 8);
+	RxWrite(&p, count & 0xff);
+	RxWrite(&p, count >> 8);
+	RxWrite(&p, 0x80);			// received ok
+	RxWrite(&p, (bcast ? 0x02 : 0) | ((frame[0] & 1) && !bcast ? 0x01 : 0));
+
+	for ( uint16_t i = 0 ; i < len ; i++ ) RxWrite(&p, frame[i]);
+	for ( uint8_t i = 0 ; i < 4 ; i++ ) RxWrite(&p, crc >> (i << 3));
+
+	setreg16(ERXWRPTL, next);
+	chip.regs[1][EPKTCNT & ADDR_MASK]++;
+	chip.regs[0][EIR] |= EIR_PKTIF;
+	enc28j60emu_Stats.rx_frames++;
+
+	UpdateInt();
+
+return 1;
+}
+
+void enc28j60emu_SetTxHook( void (*hook)(const uint8_t *frame, uint16_t len) ) {
+	TxHook = hook;
+}
+
+uint8_t enc28j60emu_PendingPackets( void ) {
+	return chip.regs[1][EPKTCNT & ADDR_MASK];
+}
+
+uint8_t enc28j60emu_RxEnabled( void ) {
+	return (chip.regs[0][ECON1] & ECON1_RXEN) != 0;
+}
+
+void enc28j60emu_SetIntHook( void (*hook)(void) ) {
+	IntHook = hook;
+}
+
+uint8_t enc28j60emu_IntPin( void ) {
+	return chip.intpin;
+}
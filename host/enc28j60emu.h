@@ -0,0 +1,58 @@
+/*
+
+  -------------------------------------------------------------------
+      enc28j60emu.h, ENC28J60 register-level model for host builds
+  -------------------------------------------------------------------
+
+	Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+
+	The model sits behind the SPI primitives of enc28j60.c when the
+	driver is compiled with ENC28J60_EMU. It implements the control
+	register banks, the 8 KB buffer memory with ERDPT/EWRPT, the RX
+	ring with EPKTCNT, the receive filters and the DMA copy and
+	checksum engines. Every byte clocked over the SPI bus is counted.
+*/
+
+#ifndef __ENC28J60EMU_H__
+#define __ENC28J60EMU_H__
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct enc28j60emu_stats {
+	uint32_t	spi_bytes;			// bytes clocked over SPI, opcodes included
+	uint32_t	spi_transactions;	// chip select assertions
+	uint32_t	rx_frames;			// frames stored in the RX ring
+	uint32_t	rx_filtered;		// frames rejected by ERXFCON
+	uint32_t	rx_dropped;		// frames lost, ring full or oversized
+	uint32_t	tx_frames;
+	uint32_t	dma_copies;
+	uint32_t	dma_checksums;
+	uint32_t	dma_bytes;
+};
+
+// SPI data register seen by the driver, exchanged by enc28j60emu_Transfer()
+extern uint8_t enc28j60emu_SPDR;
+extern struct enc28j60emu_stats enc28j60emu_Stats;
+
+void enc28j60emu_Select( uint8_t cs );
+void enc28j60emu_Transfer( void );
+
+// frame source and sink
+uint8_t enc28j60emu_ReceiveFrame( const uint8_t *frame, uint16_t len );
+void enc28j60emu_SetTxHook( void (*hook)(const uint8_t *frame, uint16_t len) );
+uint8_t enc28j60emu_PendingPackets( void );
+uint8_t enc28j60emu_RxEnabled( void );
+
+// INT pin, the hook is called on every high to low transition
+void enc28j60emu_SetIntHook( void (*hook)(void) );
+uint8_t enc28j60emu_IntPin( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ENC28J60EMU_H__ */
@@ -0,0 +1,363 @@
+/*
+
+  -------------------------------------------------------------------
+      hostmain.cpp, runs a sketch on Linux on top of enc28j60emu
+  -------------------------------------------------------------------
+
+	Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+
+	Build (from the sketch directory), pgmsums.h is generated first:
+
+	  python pgmsum.py network1.ino pgmsums.h
+	  g++ -O2 -DENC28J60_EMU -Ihost -I. -x c++ network1.ino -x none aSocket.cpp \
+	      host/hostmain.cpp -x c enc28j60.c host/enc28j60emu.c -x none -o network1
+
+	Usage:
+
+	  network1 -i tap0             attach to an existing TAP interface
+	  network1 -r in.pcap          replay frames from a capture file
+	           -w out.pcap         record transmitted frames
+	           -t ms               with -r, exit after ms of idle time (1000)
+	           -v                  print SPI cost of every frame
+	           -l n                with -i, lose every n-th frame, either direction
+	  network1 -n                  no network attached, for sketches that test themselves
+
+	In replay mode a frame is injected only once the RX ring is empty, so
+	the SPI bytes reported for a frame are the exact cost of handling it,
+	replies included.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "Arduino.h"
+#include "enc28j60emu.h"
+
+void setup();
+void loop();
+
+volatile uint8_t SPCR, SPSR, SPDR, PORTB, SPH, SPL;
+HardwareSerial Serial;
+
+static struct timespec StartTime;
+static void (*Isr[2])(void);
+static uint8_t IntEnabled = 1;
+
+static int TapFd = -1;
+static FILE *PcapIn;
+static FILE *PcapOut;
+static uint32_t Linger = 1000;
+static uint8_t Verbose;
+static uint32_t LoseEvery;
+static uint32_t TapFrames;
+
+static uint32_t IdleSince;
+static uint32_t FrameNo;
+static uint16_t FrameLen;
+static struct enc28j60emu_stats FrameStart;
+
+// ---------------------------------
+
+struct pcap_hdr {
+	uint32_t	magic;
+	uint16_t	version_major;
+	uint16_t	version_minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	network;
+};
+
+struct pcap_rec {
+	uint32_t	ts_sec;
+	uint32_t	ts_usec;
+	uint32_t	incl_len;
+	uint32_t	orig_len;
+};
+
+static void PcapWrite( FILE *f, const uint8_t *frame, uint16_t len ) {
+
+	struct timespec ts;
+	struct pcap_rec rec;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	rec.ts_sec = ts.tv_sec;
+	rec.ts_usec = ts.tv_nsec / 1000;
+	rec.incl_len = rec.orig_len = len;
+
+	fwrite(&rec, sizeof(rec), 1, f);
+	fwrite(frame, len, 1, f);
+	fflush(f);
+}
+
+static void ReportFrame( void ) {
+
+	const struct enc28j60emu_stats *st = &enc28j60emu_Stats;
+
+	if ( !Verbose || !FrameNo ) return;
+
+	fprintf(stderr, "rx #%u len %u: spi %u bytes in %u transactions, tx %u frames, dma %u bytes\n",
+			FrameNo, FrameLen,
+			st->spi_bytes - FrameStart.spi_bytes,
+			st->spi_transactions - FrameStart.spi_transactions,
+			st->tx_frames - FrameStart.tx_frames,
+			st->dma_bytes - FrameStart.dma_bytes);
+}
+
+static void Summary( void ) {
+
+	const struct enc28j60emu_stats *st = &enc28j60emu_Stats;
+
+	ReportFrame();
+
+	fprintf(stderr, "frames: rx %u filtered %u dropped %u tx %u\n",
+			st->rx_frames, st->rx_filtered, st->rx_dropped, st->tx_frames);
+	fprintf(stderr, "spi: %u bytes in %u transactions\n", st->spi_bytes, st->spi_transactions);
+	fprintf(stderr, "dma: %u copies %u checksums %u bytes\n", st->dma_copies, st->dma_checksums, st->dma_bytes);
+}
+
+// with -l, the frame is not delivered
+static uint8_t LoseFrame( void ) {
+
+	return TapFd >= 0 && LoseEvery && !(++TapFrames % LoseEvery);
+}
+
+static void TxFrame( const uint8_t *frame, uint16_t len ) {
+
+	if ( LoseFrame() ) return;
+
+	if ( TapFd >= 0 && write(TapFd, frame, len) < 0 ) perror("tap write");
+	if ( PcapOut ) PcapWrite(PcapOut, frame, len);
+}
+
+static void IntFired( void ) {
+
+	if ( IntEnabled && Isr[0] ) Isr[0]();
+}
+
+static void InjectFrame( const uint8_t *frame, uint16_t len ) {
+
+	ReportFrame();
+
+	FrameNo++;
+	FrameLen = len;
+	FrameStart = enc28j60emu_Stats;
+
+	enc28j60emu_ReceiveFrame(frame, len);
+}
+
+// feeds the chip model, called whenever the sketch looks at the clock
+static void PollInput( uint32_t now ) {
+
+	uint8_t frame[2048];
+	struct pcap_rec rec;
+
+	if ( TapFd >= 0 ) {
+
+		ssize_t n;
+		while ( (n = read(TapFd, frame, sizeof(frame))) > 0 )
+			if ( !LoseFrame() ) InjectFrame(frame, n);
+
+		return;
+	}
+
+	if ( !PcapIn ) return;
+
+	if ( !enc28j60emu_RxEnabled() || enc28j60emu_PendingPackets() ) {
+		IdleSince = now;
+		return;
+	}
+
+	if ( fread(&rec, sizeof(rec), 1, PcapIn) == 1 ) {
+
+		if ( rec.incl_len > sizeof(frame) || fread(frame, rec.incl_len, 1, PcapIn) != 1 ) {
+			fprintf(stderr, "truncated capture file\n");
+			exit(1);
+		}
+
+		InjectFrame(frame, rec.incl_len);
+		IdleSince = now;
+		return;
+	}
+
+	if ( now - IdleSince >= Linger ) {
+		Summary();
+		exit(0);
+	}
+}
+
+// ---------------------------------
+
+extern "C" {
+
+uint32_t micros( void ) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+return (ts.tv_sec - StartTime.tv_sec) * 1000000UL + (ts.tv_nsec - StartTime.tv_nsec) / 1000;
+}
+
+uint32_t millis( void ) {
+
+	uint32_t now = micros() / 1000;
+
+	PollInput(now);
+
+return now;
+}
+
+void delay( uint32_t ms ) {
+
+	uint32_t m = millis();
+
+	while ( millis() - m < ms ) usleep(1000);
+}
+
+void delayMicroseconds( uint16_t us ) {
+	usleep(us);
+}
+
+void pinMode( uint8_t, uint8_t ) { }
+void digitalWrite( uint8_t, uint8_t ) { }
+int digitalRead( uint8_t ) { return enc28j60emu_IntPin(); }
+
+void attachInterrupt( uint8_t irq, void (*isr)(void), int ) {
+	if ( irq < 2 ) Isr[irq] = isr;
+}
+
+void detachInterrupt( uint8_t irq ) {
+	if ( irq < 2 ) Isr[irq] = NULL;
+}
+
+void interrupts( void ) { IntEnabled = 1; }
+void noInterrupts( void ) { IntEnabled = 0; }
+
+char *utoa( unsigned int val, char *buf, int radix ) {
+
+	char tmp[33];
+	uint8_t i = 0, d = 0;
+
+	do {
+		uint8_t n = val % radix;
+		tmp[i++] = (n < 10) ? '0' + n : 'a' + n - 10;
+		val /= radix;
+	} while ( val );
+
+	while ( i ) buf[d++] = tmp[--i];
+	buf[d] = '\0';
+
+return buf;
+}
+
+}
+
+// ---------------------------------
+
+static int TapOpen( const char *name ) {
+
+	struct ifreq ifr;
+	int fd = open("/dev/net/tun", O_RDWR|O_NONBLOCK);
+
+	if ( fd < 0 ) return -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP|IFF_NO_PI;
+	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+
+	if ( ioctl(fd, TUNSETIFF, &ifr) < 0 ) {
+		close(fd);
+		return -1;
+	}
+
+return fd;
+}
+
+static void Usage( const char *prog ) {
+
+	fprintf(stderr, "usage: %s (-i tap | -r in.pcap | -n) [-w out.pcap] [-t ms] [-l n] [-v]\n", prog);
+	exit(2);
+}
+
+int main( int argc, char **argv ) {
+
+	int opt;
+	int nonet = 0;
+	struct pcap_hdr hdr;
+
+	while ( (opt = getopt(argc, argv, "i:r:w:t:l:vn")) != -1 ) {
+
+		switch ( opt ) {
+
+		case 'i':
+			if ( (TapFd = TapOpen(optarg)) < 0 ) {
+				perror(optarg);
+				return 1;
+			}
+		break;
+
+		case 'r':
+			if ( !(PcapIn = fopen(optarg, "rb")) || fread(&hdr, sizeof(hdr), 1, PcapIn) != 1
+					|| hdr.magic != 0xa1b2c3d4 || hdr.network != 1 ) {
+				fprintf(stderr, "%s: not an ethernet pcap file\n", optarg);
+				return 1;
+			}
+		break;
+
+		case 'w':
+			if ( !(PcapOut = fopen(optarg, "wb")) ) {
+				perror(optarg);
+				return 1;
+			}
+
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.magic = 0xa1b2c3d4;
+			hdr.version_major = 2;
+			hdr.version_minor = 4;
+			hdr.snaplen = 65535;
+			hdr.network = 1;
+			fwrite(&hdr, sizeof(hdr), 1, PcapOut);
+		break;
+
+		case 't':
+			Linger = atoi(optarg);
+		break;
+
+		case 'v':
+			Verbose = 1;
+		break;
+
+		case 'l':
+			LoseEvery = atoi(optarg);
+		break;
+
+		case 'n':
+			nonet = 1;
+		break;
+
+		default:
+			Usage(argv[0]);
+		}
+	}
+
+	if ( TapFd < 0 && !PcapIn && !nonet ) Usage(argv[0]);
+
+	clock_gettime(CLOCK_MONOTONIC, &StartTime);
+
+	enc28j60emu_SetTxHook(TxFrame);
+	enc28j60emu_SetIntHook(IntFired);
+
+	setup();
+
+	for (;;) loop();
+
+return 0;
+}
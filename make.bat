@@ -96,6 +96,27 @@ goto :nexchar
 :setsketchname
 set arduino_sketch_name=!arduino_sketch_path:%_app%\=!
 
+echo.
+echo Generating flash string checksums.
+echo.
+
+REM always regenerated, sums left over from an older string would go out as wrong checksums
+where python >nul 2>nul
+if not !errorlevel! == 0 (
+	echo ERROR! python is needed to generate pgmsums.h
+	pause
+	exit /b 1
+)
+
+for %%s in (%arduino_sketch_path%\*.ino) do (
+	python %arduino_sketch_path%\pgmsum.py %%s %arduino_sketch_path%\pgmsums.h
+	if not !errorlevel! == 0 (
+		echo ERROR! pgmsum.py failed on %%~nxs
+		pause
+		exit /b 1
+	)
+)
+
 echo.
 echo Building sketch.
 echo ( %arduino_sketch_name% )
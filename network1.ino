@@ -19,6 +19,15 @@ extern "C" {
 	#include "enc28j60.h"
 }
 
+// sums of the flash strings below, make.bat generates it on every build with
+// pgmsum.py network1.ino pgmsums.h, other builds have to run that first
+#include "pgmsums.h"
+
+// Flash string with its precomputed sum, for writev(). A string changed without
+// regenerating pgmsums.h does not compile when its length is different. A change of
+// the same length is not seen here, which is why make.bat always regenerates it.
+#define PGMPIECE(s)	{ s, sizeof(s)-1 + 0*sizeof(char[(sizeof(s)-1 == PGMLEN_##s) ? 1 : -1]), ASOCKET_PGM_DATA|ASOCKET_SUMMED, PGMSUM_##s }
+
 uint8_t hwaddr[ETH_ALEN] = {0x01,0x02,0x03,0x10,0x00,0x09};
 uint32_t ipaddr = 0x0A000009;
 uint8_t mask = 24;
@@ -148,7 +157,10 @@ void ParseRequests( struct httpreq *req, uint8_t req_num, char *data ) {
 
 void psend( char *pdata, uint16_t plen ) {
 
-	uint16_t bsent = 0;
+	struct aiovec iov[8];
+	char buf[3][20];
+	uint8_t n = 0;
+	uint8_t nbuf = 0;
 	uint16_t i;
 	
 	while ( plen ) {
@@ -156,35 +168,43 @@ void psend( char *pdata, uint16_t plen ) {
 		for ( i = 0 ; i < plen ; i++ )
 			if ( pgm_read_byte(pdata+i) == '{' ) break;
 
-		while ( i ) {
+		iov[n].data = pdata;
+		iov[n].len = i;
+		iov[n++].flags = ASOCKET_PGM_DATA;
 
-			bsent = sock.write( (uint8_t*)pdata, i, ASOCKET_MORE_DATA|ASOCKET_PGM_DATA );
-
-			pdata += bsent;
-			plen -= bsent;
-			i -= bsent;
-		}
+		pdata += i;
+		plen -= i;
 
 		if ( plen ) {
 			pdata++;
 			plen--;
 			
-			char buf[20];
-			uint8_t *data = NULL;
+			char *data = NULL;
 
 			if ( !strncmp_PP(pdata, PSTR("IP}"), 3) ) {
-				data = (uint8_t*)iptoa(buf,htonl(ipaddr));
+				data = iptoa(buf[nbuf],htonl(ipaddr));
 			} else if ( !strncmp_PP(pdata, PSTR("M}"), 2) ) {
-				data = (uint8_t*)utoa(mask, buf, 10);
+				data = utoa(mask, buf[nbuf], 10);
 			} else if ( !strncmp_PP(pdata, PSTR("GW}"), 3) ) {
-				data = (uint8_t*)iptoa(buf,htonl(defgw));
+				data = iptoa(buf[nbuf],htonl(defgw));
 			}
 
 			if ( data ) {
-				sock.write( data, strlen((char*)data), ASOCKET_MORE_DATA );
+				iov[n].data = data;
+				iov[n].len = strlen(data);
+				iov[n++].flags = ASOCKET_NOFLAGS;
+				nbuf++;
+
 				while ( plen-- && pgm_read_byte(pdata++) != '}' ) ;
 			}
 		}
+
+		// text and values are gathered while there is room for another pair
+		if ( n > 6 || nbuf == 3 || !plen ) {
+			sock.writev( iov, n, ASOCKET_MORE_DATA );
+			n = 0;
+			nbuf = 0;
+		}
 	}
 }
 
@@ -210,14 +230,22 @@ void setup() {
 	// initialize spi
 	char b;
 	SPCR = (1<<SPE) | (1<<MSTR);
-//	SPSR |= (1<<SPI2X);
+	SPSR |= (1<<SPI2X);		// Fosc/2, the ENC28J60 takes up to 20 MHz
 	b = SPSR;
 	b = SPDR;
 
+	// buffer memory split for a web server: room to stage requests, two frames in flight
+	static const struct enc28j60_layout layout = { ENC28J60_DEFSTAGE, 2 };
+	enc28j60_Layout(&layout);
+
 	// initialize enc280j60 microchip
 	enc28j60Init(hwaddr);
 	delay(10);
 
+	// ENC28J60 INT pin is wired to digital pin 2 (external interrupt 0)
+	pinMode(ETH_INT_PIN, INPUT);
+	enc28j60_AttachIRQ(0);
+
 	// on and off leds
 	enc28j60PhyWrite(PHLCON,0x880);
 	delay(500);
@@ -240,6 +268,7 @@ void loop() {
 
 	uint16_t datasize;
 	uint8_t *data;
+	static char req[ASOCKET_BUFSIZE+1];
 	
 	struct httpreq request[] = {
 			{ PSTR("pass"), NULL, 0 },
@@ -271,8 +300,10 @@ void loop() {
 
 		if ( sock.state() != ASOCK_CLOSED ) {
 
-			datasize = ASOCKET_BUFSIZE;
-			data = sock.read( &datasize );
+			// the request stays in our buffer while the reply is sent
+			datasize = sock.read( (uint8_t*)req, sizeof(req)-1 );
+			req[datasize] = '\0';
+			data = (uint8_t*)req;
 
 #ifdef __DBG__
 			Serial.println( (char*)data );
@@ -288,13 +319,15 @@ void loop() {
 							"<td width=\"80\" valign=\"center\" align=\"left\">" \
 							"<a href=\"/\">[Main page ]</a><br><a href=\"/setup.html\">[Setup page]</a></td>" \
 							"<td width=\"520\" valign=\"center\" align=\"left\" style=\"border-left: 1px solid black; padding: 5px;\">";
-				sock.write( (uint8_t*)head, sizeof(head)-1, ASOCKET_PGM_DATA|ASOCKET_MORE_DATA );
+				static const struct aiovec headv = PGMPIECE(head);
+				sock.writev( &headv, 1, ASOCKET_MORE_DATA );
 
 				if ( !strncmp_P((char*)data,PSTR("/ "),2) ) {
 
 					// index page
 					static char pindex[] PROGMEM = "Index...<br><br>";
-					sock.write( (uint8_t*)pindex, sizeof(pindex)-1, ASOCKET_PGM_DATA|ASOCKET_MORE_DATA );
+					static const struct aiovec pindexv = PGMPIECE(pindex);
+					sock.writev( &pindexv, 1, ASOCKET_MORE_DATA );
 
 				}
 
@@ -305,7 +338,8 @@ void loop() {
 									"<H2>Please login</H2>" \
 									"Pass  <INPUT NAME=\"pass\" TYPE=\"password\"><br><br>" \
 									"<INPUT TYPE=\"SUBMIT\" value=\"Login\">  <INPUT TYPE=\"RESET\" value=\"Clear\"></FORM>";
-						sock.write( (uint8_t*)login, sizeof(login)-1, ASOCKET_PGM_DATA|ASOCKET_MORE_DATA );
+						static const struct aiovec loginv = PGMPIECE(login);
+						sock.writev( &loginv, 1, ASOCKET_MORE_DATA );
 					} else {
 						static char setup[] PROGMEM = "<FORM ACTION=\"/\" METHOD=\"GET\" name=\"form\">" \
 									"<H2>Setup</H2>" \
@@ -363,7 +397,8 @@ void loop() {
 				}
 
 				static char tail[] PROGMEM = "</td></tr></table><hr width=\"600\"><small><i>Adrian Brzezinski (c) 2010</i></small></center></html>";
-				sock.write( (uint8_t*)tail, sizeof(tail)-1, ASOCKET_PGM_DATA );
+				static const struct aiovec tailv = PGMPIECE(tail);
+				sock.writev( &tailv, 1, ASOCKET_NOFLAGS );
 				sock.close();
 			}
 		}
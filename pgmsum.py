@@ -0,0 +1,64 @@
+#!/usr/bin/env python
+#
+# pgmsum.py, ones-complement sums of the PROGMEM strings of a sketch
+#
+# Author: Adrian Brzezinski <iz0@poczta.onet.pl> (C)2010
+# Copyright: GPL V2 (http://www.gnu.org/licenses/gpl.html)
+#
+# usage: pgmsum.py sketch.ino pgmsums.h
+#
+# Every "char name[] PROGMEM = ..." string gets PGMSUM_name, its 16-bit sum
+# in memory byte order (AVR is little endian, words start on even bytes),
+# and PGMLEN_name, its length without the terminating zero. The sums are
+# handed to aSocket::writev() with ASOCKET_SUMMED so the data is not summed
+# again while it goes to the chip.
+
+import re, sys
+
+ESCAPES = { 'n': '\n', 'r': '\r', 't': '\t', '0': '\0', '\\': '\\', '"': '"', "'": "'" }
+
+def unescape( s ):
+
+	out = ''
+	i = 0
+	while i < len(s):
+		if s[i] == '\\':
+			i += 1
+			out += ESCAPES[s[i]]
+		else:
+			out += s[i]
+		i += 1
+
+	return out.encode('latin-1')
+
+def pgmsum( data ):
+
+	data = bytearray(data)
+	s = 0
+	for i in range(0, len(data), 2):
+		s += data[i]
+		if i+1 < len(data): s += data[i+1] << 8
+
+	while s >> 16:
+		s = (s & 0xffff) + (s >> 16)
+
+	return s
+
+def main( src, dst ):
+
+	text = open(src).read()
+	out = [ '// Generated by pgmsum.py from %s, do not edit.' % src.replace('\\','/').split('/')[-1], '' ]
+
+	for m in re.finditer( r'char\s+(\w+)\s*\[\]\s*PROGMEM\s*=\s*((?:"(?:[^"\\]|\\.)*"\s*\\?\s*)+);', text ):
+		data = b''.join( unescape(l) for l in re.findall( r'"((?:[^"\\]|\\.)*)"', m.group(2) ) )
+		out.append( '#define PGMSUM_%s\t0x%04x' % (m.group(1), pgmsum(data)) )
+		out.append( '#define PGMLEN_%s\t%d' % (m.group(1), len(data)) )
+
+	open(dst, 'w').write( '\n'.join(out) + '\n' )
+
+if __name__ == '__main__':
+
+	if len(sys.argv) != 3:
+		sys.exit( 'usage: pgmsum.py sketch.ino pgmsums.h' )
+
+	main( sys.argv[1], sys.argv[2] )
@@ -0,0 +1,14 @@
+// Generated by pgmsum.py from network1.ino, do not edit.
+
+#define PGMSUM_head	0x8b32
+#define PGMLEN_head	424
+#define PGMSUM_pindex	0x71b1
+#define PGMLEN_pindex	16
+#define PGMSUM_login	0xbf8c
+#define PGMLEN_login	190
+#define PGMSUM_setup	0xb8e2
+#define PGMLEN_setup	603
+#define PGMSUM_refresh	0x8ab7
+#define PGMLEN_refresh	86
+#define PGMSUM_tail	0x941a
+#define PGMLEN_tail	98
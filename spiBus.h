@@ -21,13 +21,15 @@
 #define SPI_SS1_PIN			9
 #define SPI_SS2_PIN			8
 
+#define ETH_INT_PIN			2
+
 #define SPI_DEV_ETH		0
 #define SPI_DEV_RAM		2
 #define SPI_DEV_NONE		7
 
 #define spiSelectDev(addr)	( PORTB = (PORTB & 0xf8) | (addr & 0x07) )
 
-#define memoff(addr, type, mem) (uint16_t)((uint8_t*)&((type*)(addr))->mem)
+#define memoff(addr, type, mem) (uint16_t)(uintptr_t)((uint8_t*)&((type*)(uintptr_t)(addr))->mem)
 
 extern unsigned int __bss_end;
 extern unsigned int __heap_start;